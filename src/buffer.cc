@@ -28,10 +28,14 @@
 
 
 void Buffer::write(const std::vector<uint8_t>& data) {
-    ensure_size(buffer_pos_ + data.size());
-    std::copy(data.begin(), data.end(), data_.begin() + buffer_pos_);
-    mark_valid(buffer_pos_, buffer_pos_ + data.size());
-    buffer_pos_ += data.size();
+    write(data.data(), data.size());
+}
+
+void Buffer::write(const uint8_t* data, size_t size) {
+    ensure_size(buffer_pos_ + size);
+    std::copy(data, data + size, data_.begin() + buffer_pos_);
+    mark_valid(buffer_pos_, buffer_pos_ + size);
+    buffer_pos_ += size;
 }
 
 void Buffer::write(const std::vector<uint8_t>& data, size_t offset) {
@@ -40,6 +44,13 @@ void Buffer::write(const std::vector<uint8_t>& data, size_t offset) {
     mark_valid(offset, offset + data.size());
 }
 
+void Buffer::clear() {
+    std::vector<uint8_t>().swap(data_);
+    buffer_pos_ = 0;
+    start_bound_ = 0;
+    end_bound_ = 0;
+}
+
 void Buffer::ensure_size(size_t size) {
     if (data_.size() < size) {
         if ((size_t)end_bound_ == data_.size()) {
@@ -57,6 +68,10 @@ void Buffer::copy_into(uint8_t* out_data, size_t offset, size_t size) const {
 bool Buffer::valid_bytes(size_t offset, size_t size) const {
     std::streamoff end = offset + size;
 
+    // Nothing is valid beyond the data, as in a buffer that was cleared.
+    if ((size_t)end > data_.size()) {
+        return false;
+    }
     return end <= start_bound_ || (std::streamoff)offset >= end_bound_;
 }
 
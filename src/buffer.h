@@ -36,6 +36,7 @@ public:
      * will be updated.
      */
     void write(const std::vector<uint8_t>& data);
+    void write(const uint8_t* data, size_t size);
 
     /**
      * Write data to a specified position in the Buffer. The position pointer
@@ -43,6 +44,11 @@ public:
      */
     void write(const std::vector<uint8_t>& data, size_t offset);
 
+    /**
+     * Discard all data and release the memory held by the Buffer.
+     */
+    void clear();
+
     /**
      * Give the value of the internal position pointer.
      */
@@ -20,6 +20,10 @@
 
 #include "codecs/coders.h"
 
+#include "codecs/downmix.h"
+#include "codecs/resampler.h"
+#include "logging.h"
+
 /*
  * Conditionally include specific encoders and decoders based on
  * configuration.
@@ -59,13 +63,69 @@ void Encoder::set_gain(double gainref, double album_gain, double track_gain) {
 
 /* Create instance of class derived from Encoder. */
 Encoder* Encoder::CreateEncoder(std::string file_type, Buffer& buffer,
-                                size_t actual_size) {
+                                unsigned quality, size_t actual_size) {
 #ifdef HAVE_MP3
-    if (file_type == "mp3") return new Mp3Encoder(buffer, actual_size);
+    if (file_type == "mp3") {
+        return new Mp3Encoder(buffer, quality, actual_size);
+    }
 #endif
     return NULL;
 }
 
+Decoder::Decoder() {}
+
+Decoder::~Decoder() {}
+
+int Decoder::set_output(Encoder* encoder, uint64_t num_samples,
+                        int sample_rate, int channels, int sample_size,
+                        ChannelOrder order) {
+    if (channels > 2) {
+        if (!Downmix::supported(channels)) {
+            Log(ERROR) << "Unsupported number of channels: " << channels;
+            return -1;
+        }
+        Log(DEBUG) << "Mixing " << channels << " channels to stereo.";
+        downmix_.reset(new Downmix(channels, order));
+        channels = 2;
+    }
+
+    int factor = params.resample ? Resampler::factor_for(sample_rate) : 1;
+    if (factor > 1) {
+        Log(DEBUG) << "Resampling from " << sample_rate << " Hz to "
+                   << sample_rate / factor << " Hz.";
+        resampler_.reset(new Resampler(channels, factor));
+        num_samples = resampler_->output_samples(num_samples);
+        sample_rate /= factor;
+    }
+
+    return encoder->set_stream_params(num_samples, sample_rate, channels,
+                                      sample_size);
+}
+
+PcmSink* Decoder::output(PcmSink* sink) {
+    if (resampler_) {
+        resampler_->set_sink(sink);
+        sink = resampler_.get();
+    }
+    if (downmix_) {
+        downmix_->set_sink(sink);
+        sink = downmix_.get();
+    }
+    return sink;
+}
+
+/* The resampler is dropped once finished, so this only has effect once. */
+int Decoder::finish_output(PcmSink* sink) {
+    if (!resampler_) {
+        return 0;
+    }
+
+    resampler_->set_sink(sink);
+    int result = resampler_->finish();
+    resampler_.reset();
+    return result;
+}
+
 /* Create instance of class derived from Decoder. */
 Decoder* Decoder::CreateDecoder(std::string file_type) {
 #ifdef HAVE_FLAC
@@ -98,7 +158,7 @@ const std::vector<std::string> decoder_list = {
 /* Check if an encoder is available to encode to the specified type. */
 int check_encoder(const char* type) {
     Buffer b;
-    Encoder* enc = Encoder::CreateEncoder(type, b);
+    Encoder* enc = Encoder::CreateEncoder(type, b, params.quality);
     if (enc) {
         delete enc;
         return 1;
@@ -22,6 +22,7 @@
 #define CODERS_H
 
 #include <cstdint>
+#include <memory>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -70,46 +71,110 @@ enum {
     NUMBER_METATAG_FIELDS
 };
 
+/*
+ * Consumer of decoded PCM audio data. Decoders hand their output to a
+ * PcmSink, which is normally the Encoder itself, but may also be an
+ * intermediate stage that buffers or forwards the data. Data comes either
+ * as right-aligned integers of sample_size bits, or as floats from -1 to 1,
+ * in one array per channel.
+ */
+class PcmSink {
+public:
+    virtual ~PcmSink() { };
+
+    virtual int encode_pcm_data(const int32_t* const data[], int numsamples,
+                                int sample_size) = 0;
+    virtual int encode_pcm_float(const float* const data[],
+                                 int numsamples) = 0;
+};
+
 /* Encoder class interface */
-class Encoder {
+class Encoder : public PcmSink {
 public:
     virtual ~Encoder() { };
 
     virtual int set_stream_params(uint64_t num_samples, int sample_rate,
-                                  int channels) = 0;
+                                  int channels, int sample_size) = 0;
     virtual void set_text_tag(const int key, const char* value) = 0;
     virtual void set_picture_tag(const char* mime_type, int type,
                                  const char* description, const uint8_t* data,
                                  int data_length) = 0;
+    virtual int get_channels() const = 0;
     virtual void set_gain_db(const double dbgain) = 0;
     void set_gain(double gainref, double album_gain, double track_gain);
     virtual int render_tag() = 0;
+    /* The size of the tag that render_tag() put before the audio. */
+    virtual size_t get_tag_size() const { return 0; }
     virtual size_t get_actual_size() const = 0;
     virtual size_t calculate_size() const = 0;
-    virtual int encode_pcm_data(const int32_t* const data[], int numsamples,
-                                int sample_size) = 0;
     virtual int encode_finish() = 0;
 
     virtual bool no_partial_encode() { return true; }
 
+    /*
+     * Some formats have a header describing the whole stream (such as the
+     * MP3 VBR tag), which can only be written once encoding has finished.
+     * After encode_finish(), get_vbr_tag() returns that header so it can be
+     * cached. Passing a cached header to set_vbr_tag() lets the encoder
+     * write it as soon as the placeholder has been produced, instead of at
+     * the end. Encoders without such a header ignore both.
+     */
+    virtual void set_vbr_tag(const std::vector<uint8_t>& tag) { (void)tag; }
+    virtual std::vector<uint8_t> get_vbr_tag() const { return {}; }
+
     static Encoder* CreateEncoder(const std::string file_type, Buffer& buffer,
-            size_t actual_size = 0);
+            unsigned quality, size_t actual_size = 0);
 
     constexpr static double invalid_db = 1000.0;
 };
 
+/* Order of the channels of surround audio in a source format. */
+enum ChannelOrder {
+    // FLAC and WAVE: L R C LFE BL BR SL SR
+    CHANNELS_FLAC,
+    // Vorbis: L C R, then surrounds and LFE last
+    CHANNELS_VORBIS
+};
+
+class Downmix;
+class Resampler;
+
 /* Decoder class interface */
 class Decoder {
 public:
-    virtual ~Decoder() { };
-
+    Decoder();
+    virtual ~Decoder();
+
+    /*
+     * open_file() and process_metadata() return 0 on success, -1 if the
+     * file could not be read or the decoder could not be set up, or -2 if
+     * it is not a stream the decoder understands.
+     */
     virtual int open_file(const char* filename) = 0;
     /* The modified time of the decoder file */
     virtual time_t mtime() = 0;
     virtual int process_metadata(Encoder* encoder) = 0;
-    virtual int process_single_fr(Encoder* encoder) = 0;
+    virtual int process_single_fr(PcmSink* sink) = 0;
 
     static Decoder* CreateDecoder(const std::string file_type);
+
+protected:
+    /*
+     * Decoded audio goes through stages that adapt it to what the encoder
+     * can take: surround audio is mixed down to stereo, and with the
+     * resample parameter, high sample rates are brought down to 44.1 or
+     * 48 kHz. set_output() sets up the stages needed for the stream and
+     * gives the encoder the parameters of their output. Decoders then send
+     * audio to output(sink) and call finish_output(sink) at the end.
+     */
+    int set_output(Encoder* encoder, uint64_t num_samples, int sample_rate,
+                   int channels, int sample_size, ChannelOrder order);
+    PcmSink* output(PcmSink* sink);
+    int finish_output(PcmSink* sink);
+
+private:
+    std::unique_ptr<Downmix> downmix_;
+    std::unique_ptr<Resampler> resampler_;
 };
 
 /* Print codec versions. */
@@ -0,0 +1,154 @@
+/*
+ * Multichannel downmix for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "codecs/downmix.h"
+
+#include <algorithm>
+
+#include "codecs/pcm_convert.h"
+
+namespace {
+
+enum Speaker {
+    L, R, C, LFE,
+    // Surrounds, whether side or back.
+    LS, RS,
+    // Single back surround of 6.1.
+    CS
+};
+
+const int min_channels = 3;
+const int max_channels = 8;
+
+/* Speaker of each channel, for 3 to 8 channels. */
+const Speaker flac_layouts[][max_channels] = {
+    {L, R, C},
+    {L, R, LS, RS},
+    {L, R, C, LS, RS},
+    {L, R, C, LFE, LS, RS},
+    {L, R, C, LFE, CS, LS, RS},
+    {L, R, C, LFE, LS, RS, LS, RS},
+};
+
+const Speaker vorbis_layouts[][max_channels] = {
+    {L, C, R},
+    {L, R, LS, RS},
+    {L, C, R, LS, RS},
+    {L, C, R, LS, RS, LFE},
+    {L, C, R, LS, RS, CS, LFE},
+    {L, C, R, LS, RS, LS, RS, LFE},
+};
+
+/* -3 dB */
+const float minus_3db = 0.70710678f;
+
+}
+
+Downmix::Downmix(int channels, ChannelOrder order) :
+sink_(nullptr), channels_(channels), left_gain_(channels),
+right_gain_(channels) {
+    const Speaker* layout = (order == CHANNELS_FLAC ? flac_layouts
+                             : vorbis_layouts)[channels - min_channels];
+    for (int channel = 0; channel < channels; ++channel) {
+        switch (layout[channel]) {
+            case L:
+                left_gain_[channel] = 1;
+                break;
+            case R:
+                right_gain_[channel] = 1;
+                break;
+            case C:
+            case CS:
+                left_gain_[channel] = minus_3db;
+                right_gain_[channel] = minus_3db;
+                break;
+            case LS:
+                left_gain_[channel] = minus_3db;
+                break;
+            case RS:
+                right_gain_[channel] = minus_3db;
+                break;
+            case LFE:
+                break;
+        }
+    }
+
+    float left_sum = 0, right_sum = 0;
+    for (int channel = 0; channel < channels; ++channel) {
+        left_sum += left_gain_[channel];
+        right_sum += right_gain_[channel];
+    }
+    for (int channel = 0; channel < channels; ++channel) {
+        left_gain_[channel] /= left_sum;
+        right_gain_[channel] /= right_sum;
+    }
+}
+
+bool Downmix::supported(int channels) {
+    return channels >= min_channels && channels <= max_channels;
+}
+
+/* Integer samples are scaled to [-1, 1) as part of the mix. */
+int Downmix::encode_pcm_data(const int32_t* const data[], int numsamples,
+                             int sample_size) {
+    clear(numsamples);
+    float scale = 1.0f / (float)(1u << (sample_size - 1));
+    size_t n = (size_t)numsamples;
+    for (int channel = 0; channel < channels_; ++channel) {
+        if (left_gain_[channel] != 0) {
+            pcm_mix_int(left_.data(), data[channel],
+                        left_gain_[channel] * scale, n);
+        }
+        if (right_gain_[channel] != 0) {
+            pcm_mix_int(right_.data(), data[channel],
+                        right_gain_[channel] * scale, n);
+        }
+    }
+    return forward(numsamples);
+}
+
+int Downmix::encode_pcm_float(const float* const data[], int numsamples) {
+    clear(numsamples);
+    size_t n = (size_t)numsamples;
+    for (int channel = 0; channel < channels_; ++channel) {
+        if (left_gain_[channel] != 0) {
+            pcm_mix(left_.data(), data[channel], left_gain_[channel], n);
+        }
+        if (right_gain_[channel] != 0) {
+            pcm_mix(right_.data(), data[channel], right_gain_[channel], n);
+        }
+    }
+    return forward(numsamples);
+}
+
+void Downmix::clear(int numsamples) {
+    size_t n = (size_t)numsamples;
+    if (left_.size() < n) {
+        left_.resize(n);
+        right_.resize(n);
+    }
+    std::fill(left_.begin(), left_.begin() + numsamples, 0.0f);
+    std::fill(right_.begin(), right_.begin() + numsamples, 0.0f);
+}
+
+int Downmix::forward(int numsamples) {
+    const float* data[2] = {left_.data(), right_.data()};
+    return sink_->encode_pcm_float(data, numsamples);
+}
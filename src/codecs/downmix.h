@@ -0,0 +1,68 @@
+/*
+ * Multichannel downmix header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DOWNMIX_H
+#define DOWNMIX_H
+
+#include <vector>
+
+#include "codecs/coders.h"
+
+/*
+ * Mixes surround audio (3 to 8 channels) down to stereo for encoders that
+ * only take one or two channels. Decoders with more channels put one of
+ * these in front of their output (see Decoder::set_output()). Output is
+ * always float.
+ *
+ * The mix uses the ITU-R BS.775 coefficients: centre and surround channels
+ * are added at -3 dB, and LFE is left out. Each output is scaled down by
+ * the sum of its coefficients so that the mix cannot clip.
+ */
+class Downmix : public PcmSink {
+public:
+    Downmix(int channels, ChannelOrder order);
+
+    /** Return true if audio with this many channels can be mixed. */
+    static bool supported(int channels);
+
+    /** Set where the mixed audio goes. */
+    void set_sink(PcmSink* sink) { sink_ = sink; }
+
+    int encode_pcm_data(const int32_t* const data[], int numsamples,
+                        int sample_size);
+    int encode_pcm_float(const float* const data[], int numsamples);
+
+private:
+    /** Make the output buffers large enough and clear them. */
+    void clear(int numsamples);
+
+    /** Pass on the mixed buffers. */
+    int forward(int numsamples);
+
+    PcmSink* sink_;
+    const int channels_;
+    // Weight of each input channel in the left and right outputs.
+    std::vector<float> left_gain_;
+    std::vector<float> right_gain_;
+    std::vector<float> left_;
+    std::vector<float> right_;
+};
+
+#endif
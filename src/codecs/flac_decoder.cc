@@ -22,9 +22,6 @@
 #include "mp3fs.h"
 
 #include <algorithm>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <unistd.h>
 
 #include "logging.h"
 
@@ -42,31 +39,18 @@ int FlacDecoder::open_file(const char* filename) {
 
     Log(DEBUG) << "FLAC ready to initialize.";
 
-    int fd = open(filename, 0);
-    if (fd < 0) {
+    reader.reset(SourceReader::CreateReader(filename));
+    if (!reader) {
         Log(ERROR) << "FLAC open failed.";
         return -1;
     }
 
-    struct stat s;
-    if (fstat(fd, &s) < 0) {
-        Log(ERROR) << "FLAC stat failed.";
-        close(fd);
-        return -1;
-    }
-    mtime_ = s.st_mtime;
-
-    FILE *file = fdopen(fd, "r");
-    if (file == 0) {
-        Log(ERROR) << "FLAC fdopen failed.";
-        close(fd);
-        return -1;
-    }
-
-    /* Initialise decoder */
-    if (init(file) != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+    /*
+     * Initialise decoder, which reads through the callbacks below. Nothing
+     * is read yet, so a failure here says nothing about the file.
+     */
+    if (init() != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
         Log(ERROR) << "FLAC init failed.";
-        fclose(file);
         return -1;
     }
 
@@ -76,7 +60,7 @@ int FlacDecoder::open_file(const char* filename) {
 }
 
 time_t FlacDecoder::mtime() {
-    return mtime_;
+    return reader->mtime();
 }
 
 /*
@@ -90,15 +74,19 @@ time_t FlacDecoder::mtime() {
  */
 int FlacDecoder::process_metadata(Encoder* encoder) {
     encoder_c = encoder;
-    if (!process_until_end_of_metadata() || !has_streaminfo) {
-        Log(ERROR) << "FLAC is invalid.";
+    bool ok = process_until_end_of_metadata();
+    if (!ok && read_failed) {
         return -1;
+    } else if (!ok || !has_streaminfo) {
+        Log(ERROR) << "FLAC is invalid.";
+        return -2;
     }
 
-    if(encoder->set_stream_params(info.get_total_samples(),
-                                  info.get_sample_rate(),
-                                  info.get_channels()) == -1) {
-        return -1;
+    if(set_output(encoder, info.get_total_samples(),
+                  (int)info.get_sample_rate(),
+                  (int)info.get_channels(),
+                  (int)info.get_bits_per_sample(), CHANNELS_FLAC) == -1) {
+        return -2;
     }
 
     return 0;
@@ -106,12 +94,12 @@ int FlacDecoder::process_metadata(Encoder* encoder) {
 
 /*
  * Process a single frame of audio data. The encode_pcm_data() method
- * of the Encoder will be used to process the resulting audio data, with the
- * result going into the given Buffer. For FLAC, this function does little,
- * with most work handled by write_callback().
+ * of the PcmSink will be used to process the resulting audio data. For
+ * FLAC, this function does little, with most work handled by
+ * write_callback().
  */
-int FlacDecoder::process_single_fr(Encoder* encoder) {
-    encoder_c = encoder;
+int FlacDecoder::process_single_fr(PcmSink* sink) {
+    sink_c = output(sink);
     if (get_state() < FLAC__STREAM_DECODER_END_OF_STREAM) {
         if (!process_single()) {
             Log(ERROR) << "Error reading FLAC.";
@@ -121,9 +109,52 @@ int FlacDecoder::process_single_fr(Encoder* encoder) {
         return 0;
     }
 
+    if (finish_output(sink) == -1) {
+        return -1;
+    }
     return 1;
 }
 
+/* Pass data from the source file to libFLAC. */
+FLAC__StreamDecoderReadStatus FlacDecoder::read_callback(FLAC__byte buffer[],
+                                                         size_t* bytes) {
+    ssize_t n = reader->read(buffer, *bytes);
+    if (n < 0) {
+        Log(ERROR) << "FLAC read failed.";
+        read_failed = true;
+        *bytes = 0;
+        return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+    }
+
+    *bytes = (size_t)n;
+    return n == 0 ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM
+                  : FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+FLAC__StreamDecoderSeekStatus FlacDecoder::seek_callback(
+        FLAC__uint64 absolute_byte_offset) {
+    if (reader->seek((off_t)absolute_byte_offset) == -1) {
+        return FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+    }
+    return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+}
+
+FLAC__StreamDecoderTellStatus FlacDecoder::tell_callback(
+        FLAC__uint64* absolute_byte_offset) {
+    *absolute_byte_offset = (FLAC__uint64)reader->tell();
+    return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+FLAC__StreamDecoderLengthStatus FlacDecoder::length_callback(
+        FLAC__uint64* stream_length) {
+    *stream_length = (FLAC__uint64)reader->size();
+    return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+}
+
+bool FlacDecoder::eof_callback() {
+    return reader->eof();
+}
+
 /*
  * Process metadata information from the FLAC file. This routine does all the
  * heavy lifting of handling FLAC metadata. It uses the set_text_tag() and
@@ -179,16 +210,21 @@ void FlacDecoder::metadata_callback(const FLAC__StreamMetadata* metadata) {
         }
         case FLAC__METADATA_TYPE_PICTURE:
         {
-            /* add a picture tag for each picture block */
-            const FLAC::Metadata::Picture picture(metadata);
+            /*
+             * Add a picture tag for each picture block. The fields are read
+             * from libFLAC's own copy, as FLAC::Metadata::Picture would
+             * copy the whole block first.
+             */
+            const FLAC__StreamMetadata_Picture& picture =
+                metadata->data.picture;
 
             Log(DEBUG) << "FLAC processing PICTURE";
 
-            encoder_c->set_picture_tag(picture.get_mime_type(),
-                                       picture.get_type(),
-                                       (char*)picture.get_description(),
-                                       picture.get_data(),
-                                       picture.get_data_length());
+            encoder_c->set_picture_tag(picture.mime_type,
+                                       picture.type,
+                                       (char*)picture.description,
+                                       picture.data,
+                                       (int)picture.data_length);
 
             break;
         }
@@ -199,13 +235,13 @@ void FlacDecoder::metadata_callback(const FLAC__StreamMetadata* metadata) {
 
 /*
  * Process pcm audio data from the FLAC file. This function uses the
- * encode_pcm_data() methods in the stored pointer to the Encoder to encode
- * the data to the stored Buffer.
+ * encode_pcm_data() method in the stored pointer to the PcmSink to pass
+ * the data on.
  */
 FLAC__StreamDecoderWriteStatus
 FlacDecoder::write_callback(const FLAC__Frame* frame,
                             const FLAC__int32* const buffer[]) {
-    if(encoder_c->encode_pcm_data(buffer, frame->header.blocksize,
+    if(sink_c->encode_pcm_data(buffer, frame->header.blocksize,
                                   frame->header.bits_per_sample) == -1) {
         return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
     }
@@ -22,6 +22,7 @@
 #define FLAC_DECODER_H
 
 #include <map>
+#include <memory>
 #include <string>
 
 // The pragmas suppress the named warning from FLAC++, on both GCC and clang.
@@ -32,24 +33,34 @@
 #pragma GCC diagnostic pop
 
 #include "codecs/coders.h"
+#include "codecs/source_reader.h"
 
-class FlacDecoder : public Decoder, private FLAC::Decoder::File {
+class FlacDecoder : public Decoder, private FLAC::Decoder::Stream {
 public:
-    FlacDecoder() : has_streaminfo(false) {};
+    FlacDecoder() : has_streaminfo(false), read_failed(false) {};
     int open_file(const char* filename);
     time_t mtime();
     int process_metadata(Encoder* encoder);
-    int process_single_fr(Encoder* encoder);
+    int process_single_fr(PcmSink* sink);
 protected:
+    FLAC__StreamDecoderReadStatus read_callback(FLAC__byte buffer[],
+                                                size_t* bytes);
+    FLAC__StreamDecoderSeekStatus seek_callback(FLAC__uint64 absolute_byte_offset);
+    FLAC__StreamDecoderTellStatus tell_callback(FLAC__uint64* absolute_byte_offset);
+    FLAC__StreamDecoderLengthStatus length_callback(FLAC__uint64* stream_length);
+    bool eof_callback();
     FLAC__StreamDecoderWriteStatus write_callback(const FLAC__Frame* frame,
                                                   const FLAC__int32* const buffer[]);
     void metadata_callback(const FLAC__StreamMetadata* metadata);
     void error_callback(FLAC__StreamDecoderErrorStatus status);
 private:
     Encoder* encoder_c;
-    time_t mtime_;
+    PcmSink* sink_c;
+    std::unique_ptr<SourceReader> reader;
     FLAC::Metadata::StreamInfo info;
     bool has_streaminfo;
+    // Whether reading the source failed, as opposed to decoding it.
+    bool read_failed;
     typedef std::map<std::string,int> meta_map_t;
     static const meta_map_t metatag_map;
     static const meta_map_t rgtag_map;
@@ -26,6 +26,7 @@
 #include <sstream>
 #include <vector>
 
+#include "codecs/pcm_convert.h"
 #include "logging.h"
 
 /* Copied from lame */
@@ -49,11 +50,15 @@ static void lame_debug(const char *fmt, va_list list) {
 
 /*
  * Create MP3 encoder. Do not set any parameters specific to a
- * particular file. Currently error handling is poor. If we run out
- * of memory, these routines will fail silently.
+ * particular file, except for the LAME quality, which the caller may lower
+ * from the quality parameter under load. Currently error handling is poor.
+ * If we run out of memory, these routines will fail silently.
  */
-Mp3Encoder::Mp3Encoder(Buffer& buffer, size_t _actual_size) :
-actual_size(_actual_size), buffer_(buffer) {
+Mp3Encoder::Mp3Encoder(Buffer& buffer, unsigned quality,
+                       size_t _actual_size) :
+actual_size(_actual_size), vbr_tag_written(false), num_channels(0),
+stream_sample_size(0), encode_block(&Mp3Encoder::encode_generic),
+buffer_(buffer) {
     id3tag = id3_tag_new();
 
     Log(DEBUG) << "LAME ready to initialize.";
@@ -65,11 +70,11 @@ actual_size(_actual_size), buffer_(buffer) {
     /* Set lame parameters. */
     if (params.vbr) {
        lame_set_VBR(lame_encoder, vbr_mt);
-       lame_set_VBR_q(lame_encoder, params.quality);
+       lame_set_VBR_q(lame_encoder, quality);
        lame_set_VBR_max_bitrate_kbps(lame_encoder, params.bitrate);
        lame_set_bWriteVbrTag(lame_encoder, 1);
     } else {
-       lame_set_quality(lame_encoder, params.quality);
+       lame_set_quality(lame_encoder, quality);
        lame_set_brate(lame_encoder, params.bitrate);
        lame_set_bWriteVbrTag(lame_encoder, 0);
     }
@@ -92,13 +97,29 @@ Mp3Encoder::~Mp3Encoder() {
 /*
  * Set pcm stream parameters to be used by LAME encoder. This should be
  * called as soon as the information is available and must be called
- * before encode_pcm_data can be called.
+ * before encode_pcm_data can be called. The sample size in bits is the one
+ * the decoder will usually pass to encode_pcm_data, and picks the fastest
+ * encoding function for the stream.
  */
 int Mp3Encoder::set_stream_params(uint64_t num_samples, int sample_rate,
-                                   int channels) {
+                                   int channels, int sample_size) {
     lame_set_num_samples(lame_encoder, num_samples);
     lame_set_in_samplerate(lame_encoder, sample_rate);
     lame_set_num_channels(lame_encoder, channels);
+    num_channels = channels;
+    stream_sample_size = sample_size;
+
+    if (sample_size == 16 && channels == 2) {
+        encode_block = &Mp3Encoder::encode_fixed<16, 2>;
+    } else if (sample_size == 16 && channels == 1) {
+        encode_block = &Mp3Encoder::encode_fixed<16, 1>;
+    } else if (sample_size == 24 && channels == 2) {
+        encode_block = &Mp3Encoder::encode_fixed<24, 2>;
+    } else if (sample_size == 24 && channels == 1) {
+        encode_block = &Mp3Encoder::encode_fixed<24, 1>;
+    } else {
+        encode_block = &Mp3Encoder::encode_generic;
+    }
 
     Log(DEBUG) << "LAME partially initialized.";
 
@@ -260,6 +281,10 @@ void Mp3Encoder::set_picture_tag(const char* mime_type, int type,
     id3_field_setlatin1(id3_frame_field(frame, 1),
                         (id3_latin1_t*)mime_type);
     id3_field_setint(id3_frame_field(frame, 2), type);
+    /*
+     * This is the only copy of the picture data made here: libid3tag owns
+     * and frees the data of its frames, so it cannot refer to the caller's.
+     */
     id3_field_setbinarydata(id3_frame_field(frame, 4), data, data_length);
 
     id3_ucs4_t* ucs4 = id3_utf8_ucs4duplicate((id3_utf8_t *)description);
@@ -269,6 +294,11 @@ void Mp3Encoder::set_picture_tag(const char* mime_type, int type,
     }
 }
 
+/* Number of input channels, as given to set_stream_params(). */
+int Mp3Encoder::get_channels() const {
+    return lame_get_num_channels(lame_encoder);
+}
+
 /*
  * Set MP3 gain value in decibels. For MP3, there is no standard tag that can
  * be used, so the value is set directly as a gain in the encoder. The pow
@@ -312,6 +342,16 @@ int Mp3Encoder::render_tag() {
     return 0;
 }
 
+/*
+ * Use a Xing frame from a previous encode of the same file. It replaces the
+ * placeholder frame as soon as LAME has written that into the Buffer.
+ */
+void Mp3Encoder::set_vbr_tag(const std::vector<uint8_t>& tag) {
+    if (params.vbr) {
+        vbr_tag = tag;
+    }
+}
+
 /*
  * Get the actual number of bytes in the encoded file, i.e. without any
  * padding. Valid only after encode_finish() has been called.
@@ -353,34 +393,115 @@ size_t Mp3Encoder::calculate_size() const {
  */
 int Mp3Encoder::encode_pcm_data(const int32_t* const data[], int numsamples,
                                 int sample_size) {
-    /*
-     * We need to properly resample input data to a format LAME wants. LAME
-     * requires samples in a C89 sized type, left aligned (i.e. scaled to
-     * the maximum value of the type) and we cannot be sure for example how
-     * large an int is. We require it be at least 32 bits on all platforms
-     * that will run mp3fs, and rescale to the appropriate size. Cast
-     * first to avoid integer overflow.
-     */
-    std::vector<int> lbuf(numsamples), rbuf(numsamples);
-    for (int i=0; i<numsamples; ++i) {
-        lbuf[i] = (int)data[0][i] << (sizeof(int)*8 - sample_size);
-        /* ignore rbuf for mono data */
-        if (lame_get_num_channels(lame_encoder) > 1) {
-            rbuf[i] = (int)data[1][i] << (sizeof(int)*8 - sample_size);
-        }
+    if (sample_size != stream_sample_size) {
+        return encode_generic(data, numsamples, sample_size);
     }
+    return (this->*encode_block)(data, numsamples, sample_size);
+}
 
-    std::vector<uint8_t> vbuffer(5*numsamples/4 + 7200);
+/*
+ * We need to properly resample input data to a format LAME wants. LAME
+ * requires samples in a C89 sized type, left aligned (i.e. scaled to the
+ * maximum value of the type) and we cannot be sure for example how large an
+ * int is. We require it be at least 32 bits on all platforms that will run
+ * mp3fs, and rescale to the appropriate size. The scratch buffers only ever
+ * grow, so after the first block there is no allocation here.
+ */
+int Mp3Encoder::encode_generic(const int32_t* const data[], int numsamples,
+                               int sample_size) {
+    size_t n = (size_t)numsamples;
+    if (lbuf.size() < n) {
+        lbuf.resize(n);
+        rbuf.resize(n);
+    }
+    pcm_to_lame_int(data[0], lbuf.data(), n, sample_size);
+    /* ignore rbuf for mono data */
+    if (num_channels > 1) {
+        pcm_to_lame_int(data[1], rbuf.data(), n, sample_size);
+    }
+
+    int len = lame_encode_buffer_int(lame_encoder, lbuf.data(), rbuf.data(),
+                                     numsamples, output_space(n),
+                                     (int)vbuffer.size());
+    return write_output(len);
+}
 
-    int len = lame_encode_buffer_int(lame_encoder, &lbuf[0], &rbuf[0],
-                                     numsamples, vbuffer.data(),
+/*
+ * Versions of encode_generic() for the common stream formats, chosen in
+ * set_stream_params(), where the sample size and channel count are known at
+ * compile time. 16-bit audio goes to LAME as shorts, which only needs the
+ * samples narrowed, not shifted.
+ */
+template <int Bits, int Channels>
+int Mp3Encoder::encode_fixed(const int32_t* const data[], int numsamples,
+                             int) {
+    size_t n = (size_t)numsamples;
+    int len;
+    if (Bits == 16) {
+        if (lsbuf.size() < n) {
+            lsbuf.resize(n);
+            rsbuf.resize(n);
+        }
+        pcm_to_short(data[0], lsbuf.data(), n);
+        if (Channels == 2) {
+            pcm_to_short(data[1], rsbuf.data(), n);
+        }
+        len = lame_encode_buffer(lame_encoder, lsbuf.data(), rsbuf.data(),
+                                 numsamples, output_space(n),
+                                 (int)vbuffer.size());
+    } else {
+        if (lbuf.size() < n) {
+            lbuf.resize(n);
+            rbuf.resize(n);
+        }
+        pcm_to_lame_int(data[0], lbuf.data(), n, Bits);
+        if (Channels == 2) {
+            pcm_to_lame_int(data[1], rbuf.data(), n, Bits);
+        }
+        len = lame_encode_buffer_int(lame_encoder, lbuf.data(), rbuf.data(),
+                                     numsamples, output_space(n),
                                      (int)vbuffer.size());
+    }
+    return write_output(len);
+}
+
+/*
+ * Encode floating point PCM data, which LAME takes as it is, with no
+ * conversion.
+ */
+int Mp3Encoder::encode_pcm_float(const float* const data[], int numsamples) {
+    int len = lame_encode_buffer_ieee_float(lame_encoder, data[0],
+        num_channels > 1 ? data[1] : data[0], numsamples,
+        output_space((size_t)numsamples), (int)vbuffer.size());
+    return write_output(len);
+}
+
+/* Make room in vbuffer for the MP3 data of the given number of samples. */
+uint8_t* Mp3Encoder::output_space(size_t numsamples) {
+    size_t size = 5*numsamples/4 + 7200;
+    if (vbuffer.size() < size) {
+        vbuffer.resize(size);
+    }
+    return vbuffer.data();
+}
+
+/*
+ * Append len bytes of MP3 data from vbuffer to the Buffer, or fail if LAME
+ * returned an error. Once there is room, a cached VBR tag is written over
+ * the placeholder.
+ */
+int Mp3Encoder::write_output(int len) {
     if (len < 0) {
         return -1;
     }
-    vbuffer.resize(len);
 
-    buffer_.write(vbuffer);
+    buffer_.write(vbuffer.data(), (size_t)len);
+
+    if (!vbr_tag.empty() && !vbr_tag_written &&
+        buffer_.tell() >= id3size + vbr_tag.size()) {
+        buffer_.write(vbr_tag, id3size);
+        vbr_tag_written = true;
+    }
 
     return 0;
 }
@@ -408,13 +529,15 @@ int Mp3Encoder::encode_finish() {
      * already put dummy bytes here when lame_init_params() was called.
      */
     if (params.vbr) {
-        std::vector<uint8_t> tail(MAX_VBR_FRAME_SIZE);
-        size_t vbr_tag_size = lame_get_lametag_frame(lame_encoder, tail.data(),
-                MAX_VBR_FRAME_SIZE);
+        vbr_tag.resize(MAX_VBR_FRAME_SIZE);
+        size_t vbr_tag_size = lame_get_lametag_frame(lame_encoder,
+                vbr_tag.data(), MAX_VBR_FRAME_SIZE);
         if (vbr_tag_size > MAX_VBR_FRAME_SIZE) {
            return -1;
         }
-        buffer_.write(tail, id3size);
+        // Write only the frame itself, not over the audio that follows it.
+        vbr_tag.resize(vbr_tag_size);
+        buffer_.write(vbr_tag, id3size);
     }
 
     return len;
@@ -22,6 +22,7 @@
 #define MP3_ENCODER_H
 
 #include <map>
+#include <vector>
 
 #include <id3tag.h>
 #include <lame/lame.h>
@@ -33,35 +34,65 @@ class Mp3Encoder : public Encoder {
 public:
     static const size_t id3v1_tag_length = 128;
 
-    Mp3Encoder(Buffer& buffer, size_t actual_size);
+    Mp3Encoder(Buffer& buffer, unsigned quality, size_t actual_size);
     ~Mp3Encoder();
 
     int set_stream_params(uint64_t num_samples, int sample_rate,
-                          int channels);
+                          int channels, int sample_size);
     void set_text_tag(const int key, const char* value);
     void set_picture_tag(const char* mime_type, int type,
                          const char* description, const uint8_t* data,
                          int data_length);
+    int get_channels() const;
     void set_gain_db(const double dbgain);
     int render_tag();
+    size_t get_tag_size() const { return id3size; }
     size_t get_actual_size() const;
     size_t calculate_size() const;
     int encode_pcm_data(const int32_t* const data[], int numsamples,
                         int sample_size);
+    int encode_pcm_float(const float* const data[], int numsamples);
     int encode_finish();
 
     /*
      * The Xing data (which is pretty close to the beginning of the
      * file) cannot be determined until the entire file is encoded, so
-     * transcode the entire file for any read.
+     * transcode the entire file for any read, unless streaming VBR was
+     * requested. In that case, the Xing frame is served as LAME's
+     * placeholder until the real one is known.
      */
-    bool no_partial_encode() { return params.vbr; }
+    bool no_partial_encode() { return params.vbr && !params.vbrstream; }
+
+    void set_vbr_tag(const std::vector<uint8_t>& tag);
+    std::vector<uint8_t> get_vbr_tag() const { return vbr_tag; }
 
 private:
+    typedef int (Mp3Encoder::*encode_fn)(const int32_t* const data[],
+                                         int numsamples, int sample_size);
+
+    int encode_generic(const int32_t* const data[], int numsamples,
+                       int sample_size);
+    template <int Bits, int Channels>
+    int encode_fixed(const int32_t* const data[], int numsamples,
+                     int sample_size);
+    uint8_t* output_space(size_t numsamples);
+    int write_output(int len);
+
     lame_t lame_encoder;
     size_t actual_size;    // Use this as the size instead of computing it.
     struct id3_tag* id3tag;
     size_t id3size;
+    // Xing frame, either from a previous encode or after encode_finish().
+    std::vector<uint8_t> vbr_tag;
+    bool vbr_tag_written;
+    int num_channels;
+    int stream_sample_size;
+    // Encoding function for the stream format, chosen in set_stream_params().
+    encode_fn encode_block;
+    // Scratch space for encode_pcm_data(), kept to avoid reallocating.
+    std::vector<int> lbuf, rbuf;
+    std::vector<short> lsbuf, rsbuf;
+    std::vector<uint8_t> vbuffer;
     Buffer& buffer_;
     typedef std::map<int,const char*> meta_map_t;
     static const meta_map_t metatag_map;
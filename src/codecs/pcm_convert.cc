@@ -0,0 +1,276 @@
+/*
+ * PCM sample conversion source for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "codecs/pcm_convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PCM_CONVERT_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define PCM_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+typedef void (*convert_t)(const int32_t*, int*, size_t, int);
+typedef void (*narrow_t)(const int32_t*, short*, size_t);
+typedef void (*mix_t)(float*, const float*, float, size_t);
+typedef void (*mix_int_t)(float*, const int32_t*, float, size_t);
+
+/*
+ * Shift as unsigned, since shifting a negative value left is undefined. Cast
+ * first to avoid integer overflow.
+ */
+void convert_generic(const int32_t* in, int* out, size_t n, int shift) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = (int)((unsigned)in[i] << shift);
+    }
+}
+
+void narrow_generic(const int32_t* in, short* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = (short)in[i];
+    }
+}
+
+void mix_generic(float* out, const float* in, float gain, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] += gain * in[i];
+    }
+}
+
+void mix_int_generic(float* out, const int32_t* in, float gain, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] += gain * (float)in[i];
+    }
+}
+
+/*
+ * The vector kernels handle whole vectors and leave the remainder to the
+ * generic code. They are only used where int is 32 bits wide.
+ */
+
+#ifdef PCM_CONVERT_X86
+__attribute__((target("sse2")))
+void convert_sse2(const int32_t* in, int* out, size_t n, int shift) {
+    __m128i count = _mm_cvtsi32_si128(shift);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_sll_epi32(v, count));
+    }
+    convert_generic(in + i, out + i, n - i, shift);
+}
+
+__attribute__((target("sse2")))
+void narrow_sse2(const int32_t* in, short* out, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(in + i + 4));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(lo, hi));
+    }
+    narrow_generic(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void mix_sse2(float* out, const float* in, float gain, size_t n) {
+    __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(in + i), g);
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), v));
+    }
+    mix_generic(out + i, in + i, gain, n - i);
+}
+
+__attribute__((target("sse2")))
+void mix_int_sse2(float* out, const int32_t* in, float gain, size_t n) {
+    __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(in + i)));
+        v = _mm_mul_ps(v, g);
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), v));
+    }
+    mix_int_generic(out + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+void convert_avx2(const int32_t* in, int* out, size_t n, int shift) {
+    __m128i count = _mm_cvtsi32_si128(shift);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_sll_epi32(v, count));
+    }
+    convert_generic(in + i, out + i, n - i, shift);
+}
+
+// The pack works within 128-bit lanes, so the quarters need reordering.
+__attribute__((target("avx2")))
+void narrow_avx2(const int32_t* in, short* out, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(in + i + 8));
+        __m256i packed = _mm256_packs_epi32(lo, hi);
+        _mm256_storeu_si256((__m256i*)(out + i),
+                            _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    narrow_generic(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void mix_avx2(float* out, const float* in, float gain, size_t n) {
+    __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(in + i), g);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), v));
+    }
+    mix_generic(out + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+void mix_int_avx2(float* out, const int32_t* in, float gain, size_t n) {
+    __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_cvtepi32_ps(
+            _mm256_loadu_si256((const __m256i*)(in + i)));
+        v = _mm256_mul_ps(v, g);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), v));
+    }
+    mix_int_generic(out + i, in + i, gain, n - i);
+}
+#endif
+
+#ifdef PCM_CONVERT_NEON
+void convert_neon(const int32_t* in, int* out, size_t n, int shift) {
+    int32x4_t count = vdupq_n_s32(shift);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_s32(out + i, vshlq_s32(vld1q_s32(in + i), count));
+    }
+    convert_generic(in + i, out + i, n - i, shift);
+}
+
+void narrow_neon(const int32_t* in, short* out, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1_s16(out + i, vmovn_s32(vld1q_s32(in + i)));
+    }
+    narrow_generic(in + i, out + i, n - i);
+}
+
+void mix_neon(float* out, const float* in, float gain, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(out + i, vmlaq_n_f32(vld1q_f32(out + i), vld1q_f32(in + i),
+                                       gain));
+    }
+    mix_generic(out + i, in + i, gain, n - i);
+}
+
+void mix_int_neon(float* out, const int32_t* in, float gain, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vcvtq_f32_s32(vld1q_s32(in + i));
+        vst1q_f32(out + i, vmlaq_n_f32(vld1q_f32(out + i), v, gain));
+    }
+    mix_int_generic(out + i, in + i, gain, n - i);
+}
+#endif
+
+struct Kernel {
+    convert_t convert;
+    narrow_t narrow;
+    mix_t mix;
+    mix_int_t mix_int;
+    const char* name;
+};
+
+Kernel choose_kernel() {
+    if (sizeof(int) == 4) {
+#ifdef PCM_CONVERT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return {convert_avx2, narrow_avx2, mix_avx2, mix_int_avx2,
+                    "avx2"};
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return {convert_sse2, narrow_sse2, mix_sse2, mix_int_sse2,
+                    "sse2"};
+        }
+#endif
+#ifdef PCM_CONVERT_NEON
+        return {convert_neon, narrow_neon, mix_neon, mix_int_neon, "neon"};
+#endif
+    }
+    return {convert_generic, narrow_generic, mix_generic, mix_int_generic,
+            "generic"};
+}
+
+const Kernel& kernel() {
+    static const Kernel chosen = choose_kernel();
+    return chosen;
+}
+
+}
+
+void pcm_to_lame_int(const int32_t* in, int* out, size_t n, int sample_size) {
+    kernel().convert(in, out, n, (int)sizeof(int) * 8 - sample_size);
+}
+
+void pcm_to_lame_int_generic(const int32_t* in, int* out, size_t n,
+                             int sample_size) {
+    convert_generic(in, out, n, (int)sizeof(int) * 8 - sample_size);
+}
+
+void pcm_to_short(const int32_t* in, short* out, size_t n) {
+    kernel().narrow(in, out, n);
+}
+
+void pcm_to_short_generic(const int32_t* in, short* out, size_t n) {
+    narrow_generic(in, out, n);
+}
+
+void pcm_mix(float* out, const float* in, float gain, size_t n) {
+    kernel().mix(out, in, gain, n);
+}
+
+void pcm_mix_generic(float* out, const float* in, float gain, size_t n) {
+    mix_generic(out, in, gain, n);
+}
+
+void pcm_mix_int(float* out, const int32_t* in, float gain, size_t n) {
+    kernel().mix_int(out, in, gain, n);
+}
+
+void pcm_mix_int_generic(float* out, const int32_t* in, float gain,
+                         size_t n) {
+    mix_int_generic(out, in, gain, n);
+}
+
+const char* pcm_convert_kernel() {
+    return kernel().name;
+}
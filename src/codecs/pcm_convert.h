@@ -0,0 +1,69 @@
+/*
+ * PCM sample conversion header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef PCM_CONVERT_H
+#define PCM_CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Convert samples of sample_size bits to ints scaled to the full range of an
+ * int (left aligned), as LAME's int interface expects. The fastest kernel
+ * supported by the CPU is chosen on first use.
+ */
+void pcm_to_lame_int(const int32_t* in, int* out, size_t n, int sample_size);
+
+/** The same conversion done one sample at a time, for reference. */
+void pcm_to_lame_int_generic(const int32_t* in, int* out, size_t n,
+                             int sample_size);
+
+/**
+ * Narrow 16-bit samples held in 32-bit ints to shorts, for LAME's short
+ * interface.
+ */
+void pcm_to_short(const int32_t* in, short* out, size_t n);
+
+/** The same narrowing done one sample at a time, for reference. */
+void pcm_to_short_generic(const int32_t* in, short* out, size_t n);
+
+/**
+ * Add the float samples in, multiplied by gain, to out. Mixing several
+ * channels into one is a series of these.
+ */
+void pcm_mix(float* out, const float* in, float gain, size_t n);
+
+/** The same mixing done one sample at a time, for reference. */
+void pcm_mix_generic(float* out, const float* in, float gain, size_t n);
+
+/**
+ * Add the integer samples in, converted to float and multiplied by gain, to
+ * out. The gain should include the scaling of the samples to [-1, 1).
+ */
+void pcm_mix_int(float* out, const int32_t* in, float gain, size_t n);
+
+/** The same mixing done one sample at a time, for reference. */
+void pcm_mix_int_generic(float* out, const int32_t* in, float gain,
+                         size_t n);
+
+/** Name of the kernels used by the functions above, for diagnostics. */
+const char* pcm_convert_kernel();
+
+#endif
@@ -24,30 +24,32 @@
 
 #include "logging.h"
 
-/* Decode binary picture data. */
+/*
+ * Decode binary picture data. The MIME type and description are short and
+ * are copied, so they can be given out as C strings.
+ */
 bool Picture::decode() {
-    std::string picture_data_str;
+    const char* view;
 
     if (!consume_decode_uint32(type) ||
         !consume_decode_string(mime_type) ||
         !consume_decode_string(description) ||
         !consume_no_decode(16) ||
-        !consume_decode_string(picture_data_str)) {
+        !consume_view(view, picture_data_length)) {
         Log(ERROR) << "Couldn't decode picture data as valid data.";
         return false;
     }
 
-    picture_data.assign(picture_data_str.c_str(),
-                        picture_data_str.c_str() + picture_data_str.size());
+    picture_data = (const uint8_t*)view;
 
     return true;
 }
 
 /* Decode a 32-bit integer from the picture data and advance pointer. */
 bool Picture::consume_decode_uint32(uint32_t& out) {
-    if (data_off_ + 4 > data_.size()) return false;
+    if (data_off_ + 4 > size_) return false;
 
-    out = ntohl(*(uint32_t*)(data_.data() + data_off_));
+    out = ntohl(*(uint32_t*)(data_ + data_off_));
 
     data_off_ += 4;
 
@@ -56,12 +58,25 @@ bool Picture::consume_decode_uint32(uint32_t& out) {
 
 /* Decode a string from the picture data and advance pointer. */
 bool Picture::consume_decode_string(std::string& out) {
+    const char* view;
     uint32_t len;
+    if (!consume_view(view, len)) return false;
+
+    out.assign(view, len);
+
+    return true;
+}
+
+/*
+ * Find a length-prefixed field in the picture data without copying it, and
+ * advance pointer.
+ */
+bool Picture::consume_view(const char*& out, uint32_t& len) {
     if (!consume_decode_uint32(len)) return false;
 
-    if (data_off_ + len > data_.size()) return false;
+    if (data_off_ + len > size_) return false;
 
-    out.assign(data_.data() + data_off_, len);
+    out = data_ + data_off_;
 
     data_off_ += len;
 
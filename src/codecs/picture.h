@@ -21,36 +21,47 @@
 #ifndef PICTURE_H
 #define PICTURE_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
-#include <vector>
 
+/*
+ * Parser for a picture block in the FLAC format, as found base64 encoded in
+ * Vorbis comments. The picture data is not copied: get_data() points into
+ * the block given to the constructor, which must outlive the Picture.
+ */
 class Picture {
 public:
-    Picture(std::vector<char> data): data_(data), data_off_(0) {}
+    Picture(const char* data, size_t size) :
+    data_(data), size_(size), data_off_(0), picture_data(nullptr),
+    picture_data_length(0) {}
 
     bool decode();
 
     int get_type() const { return type; }
     const char* get_mime_type() const { return mime_type.c_str(); }
     const char* get_description() const { return description.c_str(); }
-    int get_data_length() const { return (int)picture_data.size(); }
-    const uint8_t* get_data() const { return picture_data.data(); }
+    int get_data_length() const { return (int)picture_data_length; }
+    const uint8_t* get_data() const { return picture_data; }
 
 private:
     bool consume_decode_uint32(uint32_t& out);
     bool consume_decode_string(std::string& out);
+    bool consume_view(const char*& out, uint32_t& len);
 
     bool consume_no_decode(size_t size) {
         data_off_ += size;
         return true;
     }
 
-    std::vector<char> data_;
+    const char* data_;
+    size_t size_;
     size_t data_off_;
 
     uint32_t type;
     std::string mime_type, description;
-    std::vector<uint8_t> picture_data;
+    const uint8_t* picture_data;
+    uint32_t picture_data_length;
 };
 
 #endif
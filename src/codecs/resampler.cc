@@ -0,0 +1,175 @@
+/*
+ * Decimating resampler for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "codecs/resampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "codecs/pcm_convert.h"
+
+namespace {
+
+/*
+ * Taps per phase. With a Blackman window this gives a transition band of
+ * about 8 kHz centred on the output Nyquist frequency, which is above the
+ * lowpass LAME applies anyway.
+ */
+const int taps_per_phase = 32;
+
+const double pi = 3.14159265358979323846;
+
+/* Round towards negative infinity, unlike integer division. */
+int floor_div(int a, int b) {
+    return a / b - (a % b < 0 ? 1 : 0);
+}
+
+}
+
+Resampler::Resampler(int channels, int factor) :
+sink_(nullptr), channels_(channels), factor_(factor),
+phases_(channels, std::vector<std::vector<float>>(factor)), received_(0),
+produced_(0), output_(channels) {
+    /*
+     * A windowed sinc with its cutoff at the output Nyquist frequency. The
+     * length is odd so that one tap is centred on the output.
+     */
+    int length = taps_per_phase * factor - 1;
+    int centre = (length - 1) / 2;
+    double sum = 0;
+    for (int j = 0; j < length; ++j) {
+        double x = (double)(j - centre) / factor;
+        double sinc = x == 0 ? 1 : std::sin(pi * x) / (pi * x);
+        double w = 2 * pi * j / (length - 1);
+        double window = 0.42 - 0.5 * std::cos(w) + 0.08 * std::cos(2 * w);
+        taps_.push_back((float)(sinc * window));
+        sum += sinc * window;
+
+        // Tap j reads input sample centre - j relative to the output.
+        int offset = centre - j;
+        tap_offset_.push_back(floor_div(offset, factor));
+        tap_phase_.push_back(offset - tap_offset_.back() * factor);
+    }
+    for (float& tap : taps_) {
+        tap = (float)(tap / sum);
+    }
+    lookahead_ = centre;
+
+    // Input before the start of the stream is silence.
+    base_ = tap_offset_.back();
+    for (auto& channel : phases_) {
+        for (auto& phase : channel) {
+            phase.assign((size_t)-base_, 0.0f);
+        }
+    }
+}
+
+int Resampler::factor_for(int sample_rate) {
+    for (int factor : {2, 4}) {
+        if (sample_rate == 44100 * factor || sample_rate == 48000 * factor) {
+            return factor;
+        }
+    }
+    return 1;
+}
+
+uint64_t Resampler::output_samples(uint64_t input_samples) const {
+    return (input_samples + (uint64_t)factor_ - 1) / (uint64_t)factor_;
+}
+
+void Resampler::push(int channel, float sample) {
+    phases_[channel][(size_t)(received_ % factor_)].push_back(sample);
+}
+
+int Resampler::encode_pcm_data(const int32_t* const data[], int numsamples,
+                               int sample_size) {
+    float scale = 1.0f / (float)(1u << (sample_size - 1));
+    for (int i = 0; i < numsamples; ++i) {
+        for (int channel = 0; channel < channels_; ++channel) {
+            push(channel, (float)data[channel][i] * scale);
+        }
+        ++received_;
+    }
+    return flush_output();
+}
+
+int Resampler::encode_pcm_float(const float* const data[], int numsamples) {
+    for (int i = 0; i < numsamples; ++i) {
+        for (int channel = 0; channel < channels_; ++channel) {
+            push(channel, data[channel][i]);
+        }
+        ++received_;
+    }
+    return flush_output();
+}
+
+/* Pad the input with silence until the last output can be computed. */
+int Resampler::finish() {
+    int64_t outputs = (int64_t)output_samples((uint64_t)received_);
+    if (outputs == 0) {
+        return 0;
+    }
+
+    int64_t needed = (outputs - 1) * factor_ + lookahead_ + 1;
+    while (received_ < needed) {
+        for (int channel = 0; channel < channels_; ++channel) {
+            push(channel, 0.0f);
+        }
+        ++received_;
+    }
+    return flush_output();
+}
+
+int Resampler::flush_output() {
+    // Output n can be computed once input n * factor_ + lookahead_ is in.
+    if (received_ <= lookahead_) {
+        return 0;
+    }
+    int64_t end = (received_ - 1 - lookahead_) / factor_ + 1;
+    if (end <= produced_) {
+        return 0;
+    }
+    size_t count = (size_t)(end - produced_);
+
+    std::vector<const float*> data(channels_);
+    for (int channel = 0; channel < channels_; ++channel) {
+        std::vector<float>& out = output_[channel];
+        out.assign(count, 0.0f);
+        for (size_t j = 0; j < taps_.size(); ++j) {
+            const std::vector<float>& in = phases_[channel][tap_phase_[j]];
+            pcm_mix(out.data(),
+                    in.data() + (produced_ + tap_offset_[j] - base_),
+                    taps_[j], count);
+        }
+        data[channel] = out.data();
+    }
+    produced_ = end;
+
+    // Drop input that no later output reads. The last tap reads the furthest back.
+    int64_t new_base = produced_ + tap_offset_.back();
+    for (auto& channel : phases_) {
+        for (auto& phase : channel) {
+            phase.erase(phase.begin(), phase.begin() + (new_base - base_));
+        }
+    }
+    base_ = new_base;
+
+    return sink_->encode_pcm_float(data.data(), (int)count);
+}
@@ -0,0 +1,96 @@
+/*
+ * Decimating resampler header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "codecs/coders.h"
+
+/*
+ * Brings high resolution audio (88.2 to 192 kHz) down to 44.1 or 48 kHz by
+ * an integer factor, so the encoder does not have to resample it. The
+ * input is low-pass filtered with a windowed sinc and only every factor-th
+ * output is computed. Output is always float.
+ *
+ * The filter is applied in polyphase form: the input is split into one
+ * stream per phase, and each filter tap then adds a contiguous run of one
+ * stream into the output, which is done with the vectorized pcm_mix().
+ *
+ * The filter is centred on each output, so the output is not delayed. It
+ * needs a little of the input after each output, which is held back until
+ * more arrives or finish() is called.
+ */
+class Resampler : public PcmSink {
+public:
+    Resampler(int channels, int factor);
+
+    /**
+     * Return the factor to reduce the sample rate by, or 1 if the rate is
+     * not one that can be brought down to 44.1 or 48 kHz.
+     */
+    static int factor_for(int sample_rate);
+
+    /** Number of output samples for the given number of input samples. */
+    uint64_t output_samples(uint64_t input_samples) const;
+
+    /** Set where the resampled audio goes. */
+    void set_sink(PcmSink* sink) { sink_ = sink; }
+
+    int encode_pcm_data(const int32_t* const data[], int numsamples,
+                        int sample_size);
+    int encode_pcm_float(const float* const data[], int numsamples);
+
+    /**
+     * Pass on the output held back at the end of the stream. This must be
+     * called once all input has been given.
+     */
+    int finish();
+
+private:
+    /** Add an input sample of a channel to the stream of its phase. */
+    void push(int channel, float sample);
+
+    /** Compute and pass on all outputs whose input has arrived. */
+    int flush_output();
+
+    PcmSink* sink_;
+    const int channels_;
+    const int factor_;
+    // Filter taps, and for each the phase stream and the offset in it from
+    // the output being computed.
+    std::vector<float> taps_;
+    std::vector<int> tap_phase_;
+    std::vector<int> tap_offset_;
+    // Input samples needed after each output.
+    int lookahead_;
+    // The input of each channel, split into one stream per phase. Element
+    // i of stream p is input sample (base_ + i) * factor_ + p.
+    std::vector<std::vector<std::vector<float>>> phases_;
+    int64_t base_;
+    // Input samples received, and output samples produced.
+    int64_t received_;
+    int64_t produced_;
+    std::vector<std::vector<float>> output_;
+};
+
+#endif
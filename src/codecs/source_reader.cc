@@ -0,0 +1,220 @@
+/*
+ * Source file reader for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "codecs/source_reader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "logging.h"
+#include "mp3fs.h"
+
+namespace {
+
+/*
+ * Serves reads by copying from a read-only mapping of the whole file. The
+ * kernel is told that access is sequential.
+ */
+class MmapReader : public SourceReader {
+public:
+    MmapReader(const struct stat& st, void* map) :
+    SourceReader(st), map_((const uint8_t*)map) {
+        madvise(map, (size_t)size(), MADV_SEQUENTIAL);
+    }
+    ~MmapReader() {
+        munmap((void*)map_, (size_t)size());
+    }
+
+protected:
+    ssize_t read_at(uint8_t* buf, size_t len, off_t offset) {
+        std::memcpy(buf, map_ + offset, len);
+        return (ssize_t)len;
+    }
+
+    /* madvise() needs a page aligned start. */
+    void advise(off_t offset, off_t len) {
+        off_t page = sysconf(_SC_PAGESIZE);
+        off_t start = offset / page * page;
+        madvise((void*)(map_ + start), (size_t)(offset + len - start),
+                MADV_WILLNEED);
+    }
+
+private:
+    const uint8_t* map_;
+};
+
+/*
+ * Serves reads from a buffer that is refilled with one large pread() at a
+ * time. Reads larger than the buffer go straight to the caller's memory.
+ */
+class PreadReader : public SourceReader {
+public:
+    PreadReader(const struct stat& st, int fd) :
+    SourceReader(st), fd_(fd), buffer_(buffer_size), buffer_start_(0),
+    buffer_len_(0) {
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    ~PreadReader() {
+        close(fd_);
+    }
+
+protected:
+    ssize_t read_at(uint8_t* buf, size_t len, off_t offset) {
+        if (offset < buffer_start_ ||
+            offset >= buffer_start_ + (off_t)buffer_len_) {
+            if (len >= buffer_size) {
+                return pread_all(buf, len, offset);
+            }
+            ssize_t filled = pread_all(buffer_.data(),
+                std::min((off_t)buffer_size, size() - offset), offset);
+            if (filled <= 0) {
+                return filled;
+            }
+            buffer_start_ = offset;
+            buffer_len_ = (size_t)filled;
+        }
+
+        size_t skip = (size_t)(offset - buffer_start_);
+        len = std::min(len, buffer_len_ - skip);
+        std::copy(buffer_.begin() + skip, buffer_.begin() + skip + len, buf);
+        return (ssize_t)len;
+    }
+
+    void advise(off_t offset, off_t len) {
+        posix_fadvise(fd_, offset, len, POSIX_FADV_WILLNEED);
+    }
+
+private:
+    static const size_t buffer_size = 256*1024;
+
+    /** Read len bytes, unless the file ends first. */
+    ssize_t pread_all(uint8_t* buf, size_t len, off_t offset) {
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(fd_, buf + done, len - done,
+                              offset + (off_t)done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0) {
+                return -1;
+            } else if (n == 0) {
+                break;
+            }
+            done += (size_t)n;
+        }
+        return (ssize_t)done;
+    }
+
+    const int fd_;
+    std::vector<uint8_t> buffer_;
+    off_t buffer_start_;
+    size_t buffer_len_;
+};
+
+}
+
+SourceReader* SourceReader::CreateReader(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        Log(ERROR) << "Source open failed: " << filename;
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        Log(ERROR) << "Source stat failed: " << filename;
+        close(fd);
+        return NULL;
+    }
+
+    /*
+     * Empty files cannot be mapped. A file that shrinks while it is mapped
+     * makes reads past the new end raise SIGBUS, which is why mmap is only
+     * used when asked for; pread has no such problem.
+     */
+    if (std::string(params.sourceio) == "mmap" && st.st_size > 0) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                         fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);
+            return new MmapReader(st, map);
+        }
+        Log(DEBUG) << "Source mmap failed, using pread: " << filename;
+    }
+
+    return new PreadReader(st, fd);
+}
+
+bool SourceReader::check_method(const char* method) {
+    std::string m(method ? method : "");
+    return m == "mmap" || m == "pread";
+}
+
+ssize_t SourceReader::read(uint8_t* buf, size_t len) {
+    if (pos_ >= size_) {
+        return 0;
+    }
+
+    read_ahead();
+    len = (size_t)std::min((off_t)len, size_ - pos_);
+    ssize_t n = read_at(buf, len, pos_);
+    if (n > 0) {
+        pos_ += n;
+    }
+    return n;
+}
+
+int SourceReader::seek(off_t offset) {
+    if (offset < 0) {
+        return -1;
+    }
+    pos_ = offset;
+    return 0;
+}
+
+/*
+ * The window is topped up once half of it has been read, so between half
+ * and all of it is always requested ahead of the decoder, in a few large
+ * requests rather than many small ones. After a seek, it starts over from
+ * the new position.
+ */
+void SourceReader::read_ahead() {
+    off_t depth = (off_t)params.readahead * 1024;
+    if (depth == 0) {
+        return;
+    }
+
+    if (advised_ < pos_ || advised_ > pos_ + depth) {
+        advised_ = pos_;
+    }
+    if (advised_ >= size_ || advised_ - pos_ > depth/2) {
+        return;
+    }
+
+    off_t end = std::min(pos_ + depth, size_);
+    advise(advised_, end - advised_);
+    advised_ = end;
+}
@@ -0,0 +1,98 @@
+/*
+ * Source file reader header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef SOURCE_READER_H
+#define SOURCE_READER_H
+
+#include <cstdint>
+#include <ctime>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * Sequential reader for the source files that decoders work on. Decoders
+ * drive it through their library's I/O callbacks instead of a stdio FILE,
+ * so reads are served either straight from a memory mapping of the file
+ * ("mmap") or from large pread() calls into a private buffer ("pread").
+ * The method is chosen with the sourceio parameter.
+ *
+ * Either way, the kernel is asked to start reading the next readahead
+ * kilobytes of the file while the decoder works on the current data, so
+ * that slow storage is read in parallel with encoding.
+ */
+class SourceReader {
+public:
+    virtual ~SourceReader() {}
+
+    /**
+     * Open the named file with the method given by the sourceio parameter.
+     * Returns NULL on failure. If the file cannot be mapped, the pread
+     * method is used instead.
+     */
+    static SourceReader* CreateReader(const char* filename);
+
+    /** Return true if the name is one of the supported methods. */
+    static bool check_method(const char* method);
+
+    /**
+     * Copy up to len bytes at the current position into buf, and advance
+     * past them. Returns the number of bytes copied, 0 at the end of the
+     * file, or -1 on error.
+     */
+    ssize_t read(uint8_t* buf, size_t len);
+
+    /** Move to the given position. Returns -1 if it is negative. */
+    int seek(off_t offset);
+
+    off_t tell() const { return pos_; }
+    off_t size() const { return size_; }
+    bool eof() const { return pos_ >= size_; }
+    time_t mtime() const { return mtime_; }
+
+protected:
+    explicit SourceReader(const struct stat& st) :
+    size_(st.st_size), mtime_(st.st_mtime), pos_(0), advised_(0) {}
+    SourceReader(const SourceReader&)            = delete;
+    SourceReader& operator=(const SourceReader&) = delete;
+
+    /**
+     * Copy len bytes at offset into buf. The range is always inside the
+     * file. Returns the number of bytes copied or -1 on error.
+     */
+    virtual ssize_t read_at(uint8_t* buf, size_t len, off_t offset) = 0;
+
+    /**
+     * Ask the kernel to start reading the range into the page cache,
+     * without waiting for it.
+     */
+    virtual void advise(off_t offset, off_t len) = 0;
+
+private:
+    /** Keep the read-ahead window in front of the current position. */
+    void read_ahead();
+
+    const off_t size_;
+    const time_t mtime_;
+    off_t pos_;
+    // End of the range already passed to advise().
+    off_t advised_;
+};
+
+#endif
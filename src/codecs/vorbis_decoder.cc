@@ -22,15 +22,50 @@
 #include "mp3fs.h"
 
 #include <algorithm>
+#include <cstdio>
 #include <cstdlib>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <cstring>
 
 #include "codecs/picture.h"
-#include "lib/base64.h"
+#include "lib/base64_fast.h"
 #include "logging.h"
 
+namespace {
+
+/* libvorbisfile I/O callbacks, which read from a SourceReader. */
+size_t read_source(void* ptr, size_t size, size_t nmemb, void* datasource) {
+    SourceReader* reader = (SourceReader*)datasource;
+    if (size == 0) {
+        return 0;
+    }
+    ssize_t n = reader->read((uint8_t*)ptr, size * nmemb);
+    return n < 0 ? 0 : (size_t)n / size;
+}
+
+int seek_source(void* datasource, ogg_int64_t offset, int whence) {
+    SourceReader* reader = (SourceReader*)datasource;
+    switch (whence) {
+        case SEEK_CUR:
+            offset += reader->tell();
+            break;
+        case SEEK_END:
+            offset += reader->size();
+            break;
+    }
+    return reader->seek((off_t)offset);
+}
+
+long tell_source(void* datasource) {
+    return (long)((SourceReader*)datasource)->tell();
+}
+
+/* The reader is owned and closed by the decoder, not by libvorbisfile. */
+const ov_callbacks source_callbacks = {
+    read_source, seek_source, NULL, tell_source
+};
+
+}
+
 /* Free the OggVorbis_File data structure and close the open Ogg Vorbis file
  * after the decoding process has finished.
  */
@@ -47,32 +82,17 @@ int VorbisDecoder::open_file(const char* filename) {
 
     Log(DEBUG) << "Ogg Vorbis decoder: Initializing.";
 
-    int fd = open(filename, 0);
-    if (fd < 0) {
+    reader.reset(SourceReader::CreateReader(filename));
+    if (!reader) {
         Log(ERROR) << "Ogg Vorbis decoder: open failed.";
         return -1;
     }
 
-    struct stat s;
-    if (fstat(fd, &s) < 0) {
-        Log(ERROR) << "Ogg Vorbis decoder: fstat failed.";
-        close(fd);
-        return -1;
-    }
-    mtime_ = s.st_mtime;
-
-    FILE *file = fdopen(fd, "r");
-    if (file == 0) {
-        Log(ERROR) << "Ogg Vorbis decoder: fdopen failed.";
-        close(fd);
-        return -1;
-    }
-
     /* Initialise decoder */
-    if (ov_open(file, &vf, NULL, 0) < 0) {
+    int ret = ov_open_callbacks(reader.get(), &vf, NULL, 0, source_callbacks);
+    if (ret < 0) {
         Log(ERROR) << "Ogg Vorbis decoder: Initialization failed.";
-        fclose(file);
-        return -1;
+        return ret == OV_EREAD ? -1 : -2;
     }
 
     return 0;
@@ -80,7 +100,7 @@ int VorbisDecoder::open_file(const char* filename) {
 
 
 time_t VorbisDecoder::mtime() {
-    return mtime_;
+    return reader->mtime();
 }
 
 
@@ -96,25 +116,20 @@ int VorbisDecoder::process_metadata(Encoder* encoder) {
 
     if ((vi = ov_info(&vf, -1)) == NULL) {
         Log(ERROR) << "Ogg Vorbis decoder: Failed to retrieve the file info.";
-        return -1;
+        return -2;
     }
 
-    if (vi->channels > 2) {
-        Log(ERROR) << "Ogg Vorbis decoder: Only mono/stereo audio currently supported.";
-        return -1;
-    }
-
-    if (encoder->set_stream_params(
-            ov_pcm_total(&vf, -1),
+    if (set_output(encoder,
+            (uint64_t)ov_pcm_total(&vf, -1),
             (int)vi->rate,
-            vi->channels) == -1) {
+            vi->channels, 16, CHANNELS_VORBIS) == -1) {
         Log(ERROR) << "Ogg Vorbis decoder: Failed to set encoder stream parameters.";
-        return -1;
+        return -2;
     }
 
     if ((vc = ov_comment(&vf, -1)) == NULL) {
         Log(ERROR) << "Ogg Vorbis decoder: Failed to retrieve the Ogg Vorbis comment.";
-        return -1;
+        return -2;
     }
 
     double gainref = Encoder::invalid_db,
@@ -126,15 +141,22 @@ int VorbisDecoder::process_metadata(Encoder* encoder) {
         /*
          * Get the tagname - tagvalue pairs
          */
-        std::string comment(vc->user_comments[i], vc->comment_lengths[i]);
-        size_t delimiter_pos = comment.find_first_of('=');
+        const char* comment = vc->user_comments[i];
+        size_t comment_len = (size_t)vc->comment_lengths[i];
+        const char* delimiter =
+            (const char*)std::memchr(comment, '=', comment_len);
 
-        if (delimiter_pos == 0 || delimiter_pos == std::string::npos) {
+        if (delimiter == comment || delimiter == nullptr) {
             continue;
         }
 
-        std::string tagname = comment.substr(0, delimiter_pos);
-        std::string tagvalue = comment.substr(delimiter_pos + 1);
+        /*
+         * The value is used in place rather than copied, as it may be a
+         * large picture. libvorbis keeps each comment NUL-terminated.
+         */
+        std::string tagname(comment, delimiter);
+        const char* tagvalue = delimiter + 1;
+        size_t tagvalue_len = (size_t)(comment + comment_len - tagvalue);
 
         /*
          * Normalize tag name to uppercase.
@@ -149,28 +171,28 @@ int VorbisDecoder::process_metadata(Encoder* encoder) {
         meta_map_t::const_iterator it = metatag_map.find(tagname);
 
         if (it != metatag_map.end()) {
-            encoder->set_text_tag(it->second, tagvalue.c_str());
+            encoder->set_text_tag(it->second, tagvalue);
         }
         else if (params.gainmode == 0) {
             it = rgtag_map.find(tagname);
             if (it != rgtag_map.end()) {
-                encoder->set_text_tag(it->second, tagvalue.c_str());
+                encoder->set_text_tag(it->second, tagvalue);
             }
         }
         else if (tagname == "METADATA_BLOCK_PICTURE") {
-            char* data;
+            // Left uninitialized, as it is about to be overwritten.
+            std::unique_ptr<char[]> data(
+                new char[BASE64_DECODED_MAX(tagvalue_len)]);
             size_t data_len;
-            base64_decode_alloc(tagvalue.c_str(), tagvalue.size(),
-                                &data, &data_len);
-            if (data == nullptr) {
+            if (!base64_decode_fast(tagvalue, tagvalue_len,
+                                    data.get(), &data_len)) {
                 Log(ERROR) <<
                         "Failed to decode METADATA_BLOCK_PICTURE; invalid "
-                        "base64 or could not allocate memory.";
-                return -1;
+                        "base64.";
+                return -2;
             }
 
-            Picture picture({data, data + data_len});
-            free(data);
+            Picture picture(data.get(), data_len);
 
             if (picture.decode()) {
                 encoder->set_picture_tag(picture.get_mime_type(),
@@ -181,13 +203,13 @@ int VorbisDecoder::process_metadata(Encoder* encoder) {
             }
         }
         else if (tagname == "REPLAYGAIN_REFERENCE_LOUDNESS") {
-            gainref = atof(tagvalue.c_str());
+            gainref = atof(tagvalue);
         }
         else if (tagname == "REPLAYGAIN_ALBUM_GAIN") {
-            album_gain = atof(tagvalue.c_str());
+            album_gain = atof(tagvalue);
         }
         else if (tagname == "REPLAYGAIN_TRACK_GAIN") {
-            track_gain = atof(tagvalue.c_str());
+            track_gain = atof(tagvalue);
         }
     }
 
@@ -197,56 +219,56 @@ int VorbisDecoder::process_metadata(Encoder* encoder) {
 }
 
 /*
- * Process a single frame of audio data. The encode_pcm_data() method
- * of the Encoder will be used to process the resulting audio data, with the
- * result going into the given Buffer.
+ * Process a block of audio data. libvorbisfile returns at most one packet
+ * (a few hundred samples) per call, so calls are repeated until a block of
+ * block_samples is filled or the file ends. The encode_pcm_float() method
+ * of the PcmSink will be used to process the resulting audio data.
  */
-int VorbisDecoder::process_single_fr(Encoder* encoder) {
-    std::vector<int16_t> decode_buffer(2048);
-
-    long read_bytes = ov_read(&vf, (char*)decode_buffer.data(),
-                              (int)(2 * decode_buffer.size()),
-                              0, 2, 1, &current_section);
-
-    long total_samples = read_bytes / 2;
-
-    if (total_samples > 0) {
-        long samples_per_channel = total_samples / vi->channels;
+int VorbisDecoder::process_single_fr(PcmSink* sink) {
+    if (decode_buffer.size() != (size_t)vi->channels) {
+        decode_buffer.assign(vi->channels, std::vector<float>(block_samples));
+    }
 
-        if (samples_per_channel < 1) {
-            Log(ERROR) << "Ogg Vorbis decoder: Not enough samples per channel.";
+    int filled = 0;
+    while (filled < block_samples) {
+        float** pcm;
+        long samples_per_channel = ov_read_float(&vf, &pcm,
+                                                 block_samples - filled,
+                                                 &current_section);
+        if (samples_per_channel == 0) {
+            break;
+        } else if (samples_per_channel < 0) {
+            Log(ERROR) << "Ogg Vorbis decoder: Failed to read file.";
             return -1;
         }
 
-        std::vector<std::vector<int32_t>>
-            encode_buffer(vi->channels, std::vector<int32_t>(samples_per_channel));
-        int32_t* encode_buffer_ptr[vi->channels];
-
         for (int channel = 0; channel < vi->channels; ++channel) {
-            encode_buffer_ptr[channel] = encode_buffer[channel].data();
-            for (long i = 0; i < samples_per_channel; ++i) {
-                encode_buffer[channel][i] = decode_buffer[i * vi->channels + channel];
-            }
+            std::copy(pcm[channel], pcm[channel] + samples_per_channel,
+                      decode_buffer[channel].begin() + filled);
         }
+        filled += (int)samples_per_channel;
+    }
 
-        /* Send integer buffer to encoder */
-        if (encoder->encode_pcm_data(encode_buffer_ptr,
-                                     (int)samples_per_channel, 16) < 0) {
-            Log(ERROR) << "Ogg Vorbis decoder: Failed to encode integer buffer.";
-
+    if (filled == 0) {
+        Log(DEBUG) << "Ogg Vorbis decoder: Reached end of file.";
+        if (finish_output(sink) < 0) {
+            Log(ERROR) << "Ogg Vorbis decoder: Failed to encode float buffer.";
             return -1;
         }
-
-        return 0;
-    }
-    else if (total_samples == 0) {
-        Log(DEBUG) << "Ogg Vorbis decoder: Reached end of file.";
         return 1;
     }
-    else {
-        Log(ERROR) << "Ogg Vorbis decoder: Failed to read file.";
+
+    std::vector<const float*> data(vi->channels);
+    for (int channel = 0; channel < vi->channels; ++channel) {
+        data[channel] = decode_buffer[channel].data();
+    }
+
+    if (output(sink)->encode_pcm_float(data.data(), filled) < 0) {
+        Log(ERROR) << "Ogg Vorbis decoder: Failed to encode float buffer.";
         return -1;
     }
+
+    return 0;
 }
 
 const VorbisDecoder::meta_map_t VorbisDecoder::metatag_map = {
@@ -22,11 +22,15 @@
 #define VORBIS_DECODER_H
 
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <vorbis/vorbisfile.h>
 
 #include "codecs/coders.h"
+#include "codecs/source_reader.h"
+#include "pcm_staging.h"
 
 class VorbisDecoder : public Decoder {
 public:
@@ -34,12 +38,19 @@ public:
     int open_file(const char* filename);
     time_t mtime();
     int process_metadata(Encoder* encoder);
-    int process_single_fr(Encoder* encoder);
+    int process_single_fr(PcmSink* sink);
 private:
-    time_t mtime_;
+    std::unique_ptr<SourceReader> reader;
     OggVorbis_File vf;
     vorbis_info *vi;
     int current_section;
+    /*
+     * Decoded audio is collected here, one array per channel, until a
+     * whole block of block_samples is ready for the sink. The size matches
+     * the blocks of PcmStaging, which then passes them on without copying.
+     */
+    static const int block_samples = PcmStaging::block_samples;
+    std::vector<std::vector<float>> decode_buffer;
     typedef std::map<std::string,int> meta_map_t;
     static const meta_map_t metatag_map;
     static const meta_map_t rgtag_map;
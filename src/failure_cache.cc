@@ -0,0 +1,73 @@
+/*
+ * Failed source file cache source for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "failure_cache.h"
+
+#include <algorithm>
+
+#include "logging.h"
+
+namespace {
+
+/* Number of failed files remembered. */
+const size_t max_failures = 4096;
+
+}
+
+bool FailureCache::has_failed(const std::string& filename,
+                              const struct stat& st) {
+    std::lock_guard<std::mutex> l(mutex_);
+    auto p = entries_.find(key_t(st.st_dev, st.st_ino));
+    if (p == entries_.end()) {
+        return false;
+    }
+
+    if (p->second.mtime != st.st_mtime || p->second.size != st.st_size) {
+        Log(DEBUG) << "Failed file '" << filename <<
+            "' has changed, trying again.";
+        order_.erase(std::find(order_.begin(), order_.end(), p->first));
+        entries_.erase(p);
+        return false;
+    }
+
+    ++hits_;
+    Log(DEBUG) << "Not retrying failed file '" << filename << "' (" <<
+        hits_ << " attempts skipped, " << entries_.size() <<
+        " files failed).";
+    return true;
+}
+
+void FailureCache::add(const std::string& filename, const struct stat& st) {
+    std::lock_guard<std::mutex> l(mutex_);
+    key_t key(st.st_dev, st.st_ino);
+    if (!entries_.insert({key, Failure{st.st_mtime, st.st_size}}).second) {
+        return;
+    }
+    order_.push_back(key);
+    ++failures_;
+
+    Log(ERROR) << "Could not decode '" << filename << "'. It will not be " <<
+        "tried again until it changes (" << failures_ << " failures so far).";
+
+    if (order_.size() > max_failures) {
+        entries_.erase(order_.front());
+        order_.pop_front();
+    }
+}
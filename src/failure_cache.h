@@ -0,0 +1,69 @@
+/*
+ * Failed source file cache header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef FAILURE_CACHE_H
+#define FAILURE_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+/*
+ * Remembers source files that could not be decoded, so that later attempts
+ * fail at once instead of repeating the same I/O and error messages. A file
+ * is identified by its device and inode, and an entry only applies while
+ * the modified time and size are unchanged, so a repaired or replaced file
+ * is tried again.
+ */
+class FailureCache {
+public:
+    FailureCache() : hits_(0), failures_(0) {}
+    FailureCache(const FailureCache&)            = delete;
+    FailureCache& operator=(const FailureCache&) = delete;
+
+    /** Return true if the file described by st is known to fail. */
+    bool has_failed(const std::string& filename, const struct stat& st);
+
+    /** Record that the file described by st could not be decoded. */
+    void add(const std::string& filename, const struct stat& st);
+
+private:
+    typedef std::pair<dev_t, ino_t> key_t;
+
+    struct Failure {
+        time_t mtime;
+        off_t size;
+    };
+
+    std::map<key_t, Failure> entries_;
+    // Keys in the order they were added, to drop the oldest when full.
+    std::deque<key_t> order_;
+    size_t hits_;
+    size_t failures_;
+    std::mutex mutex_;
+};
+
+#endif
@@ -28,17 +28,121 @@
 #include <fuse.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <fstream>
+#include <future>
 #include <memory>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "codecs/coders.h"
 #include "logging.h"
 #include "mp3fs.h"
+#include "prefetch.h"
 #include "transcode.h"
+#include "work_queue.h"
 
 namespace {
 
+Prefetcher prefetcher;
+
+/*
+ * Deletes released Transcoders, so that freeing the buffer and closing the
+ * codecs does not hold up the FUSE thread that handles the release.
+ */
+WorkQueue reaper(1);
+
+/*
+ * The FUSE request that the current pool thread is working on, set while
+ * running an operation on behalf of a FUSE thread (see run_on()).
+ */
+thread_local const fuse_context* request_context = nullptr;
+thread_local const std::atomic<bool>* request_interrupted = nullptr;
+
+/* How often a FUSE thread waiting for a pool checks for interrupts. */
+const std::chrono::milliseconds interrupt_poll_interval(100);
+
+/*
+ * The most threads that the multithreaded loop of libfuse 2.9 runs. An
+ * operation passed to a pool still keeps its FUSE thread waiting, so once
+ * this many are waiting, no thread is left to take new requests of either
+ * kind, and the pools no longer keep metadata and data apart.
+ */
+const unsigned fuse_max_threads = 10;
+
+/* Number of FUSE threads waiting for a pool. */
+std::atomic<unsigned> pool_waiters(0);
+
+/* Like fuse_get_context(), but also works on pool threads. */
+const fuse_context* caller() {
+    return request_context ? request_context : fuse_get_context();
+}
+
+/* Like fuse_interrupted(), but also works on pool threads. */
+int interrupted() {
+    return request_interrupted ? (int)*request_interrupted :
+        fuse_interrupted();
+}
+
+/*
+ * Worker pools for metadata and data operations, or nullptr to run them on
+ * the FUSE thread. Created on first use, once the parameters are known.
+ */
+WorkQueue* metadata_pool() {
+    static WorkQueue pool(params.metathreads);
+    return params.metathreads > 0 ? &pool : nullptr;
+}
+
+WorkQueue* data_pool() {
+    static WorkQueue pool(params.datathreads);
+    return params.datathreads > 0 ? &pool : nullptr;
+}
+
+/*
+ * Run a FUSE operation on the given pool and wait for its result, passing
+ * on the request context and any interrupt. Without a pool, the operation
+ * runs directly. Running out of FUSE threads this way is logged, as it
+ * defeats the pools (see fuse_max_threads).
+ */
+template <typename Op>
+int run_on(WorkQueue* pool, Op op) {
+    if (!pool) {
+        return op();
+    }
+
+    fuse_context context = *fuse_get_context();
+    std::atomic<bool> was_interrupted(false);
+    std::promise<int> result;
+    std::future<int> done = result.get_future();
+
+    pool->push([&] {
+        request_context = &context;
+        request_interrupted = &was_interrupted;
+        int ret = op();
+        request_context = nullptr;
+        request_interrupted = nullptr;
+        result.set_value(ret);
+    });
+
+    if (++pool_waiters == fuse_max_threads) {
+        Log(INFO) << "All " << fuse_max_threads << " FUSE threads are "
+            "waiting for the thread pools. New operations wait until one is "
+            "done.";
+    }
+    while (done.wait_for(interrupt_poll_interval) !=
+           std::future_status::ready) {
+        if (fuse_interrupted()) {
+            was_interrupted = true;
+        }
+    }
+    --pool_waiters;
+    return done.get();
+}
+
 /**
  * Translate file names from FUSE to the original absolute path.
  */
@@ -82,6 +186,25 @@ void compute_destination(char* path) {
     }
 }
 
+/*
+ * Guess whether the given process is copying files in bulk rather than
+ * playing them, based on its name. Such readers are never paced.
+ */
+bool is_bulk_copier(pid_t pid) {
+    static const std::set<std::string> copiers = {
+        "cat", "cp", "dd", "install", "pv", "rsync", "scp", "sftp-server",
+        "tar",
+    };
+
+    std::ifstream comm("/proc/" + std::to_string(pid) + "/comm");
+    std::string name;
+    if (!std::getline(comm, name)) {
+        return false;
+    }
+
+    return copiers.count(name) > 0;
+}
+
 int mp3fs_readlink(const char *path, char *buf, size_t size) {
     Log(DEBUG) << "readlink " << path;
 
@@ -118,6 +241,7 @@ int mp3fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         return -errno;
     }
 
+    std::vector<std::string> transcodable;
     while (struct dirent* de = readdir(dp.get())) {
         std::string origfile = origpath + "/" + de->d_name;
 
@@ -125,6 +249,10 @@ int mp3fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         if (lstat(origfile.c_str(), &st) == -1) {
             return -errno;
         } else {
+            const char* ext = strrchr(de->d_name, '.');
+            if (S_ISREG(st.st_mode) && ext && check_decoder(ext + 1)) {
+                transcodable.push_back(de->d_name);
+            }
             if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
                 // TODO: Make this safe if converting from short to long ext.
                 compute_destination(de->d_name);
@@ -134,6 +262,8 @@ int mp3fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         if (filler(buf, de->d_name, &st, 0)) break;
     }
 
+    prefetcher.note_listing(origpath, std::move(transcodable));
+
     return 0;
 }
 
@@ -169,6 +299,16 @@ int mp3fs_getattr(const char *path, struct stat *stbuf) {
 
         stbuf->st_size = trans.get_size();
         stbuf->st_blocks = (stbuf->st_size + 512 - 1) / 512;
+
+        /*
+         * Report the estimate now, and find out the exact size in the
+         * background. The kernel asks again once its cached attributes
+         * expire (see the attr_timeout option), and then gets the exact
+         * size from the stats cache.
+         */
+        if (trans.size_is_estimate() && params.statcachesize > 0) {
+            Transcoder::refine_size_async(origpath, trans.get_quality());
+        }
     }
 
     return 0;
@@ -199,9 +339,19 @@ int mp3fs_open(const char *path, struct fuse_file_info *fi) {
 
     find_original(&origpath);
 
-    std::unique_ptr<Transcoder> trans(new Transcoder(origpath));
-    if (!trans->open()) {
-        return -errno;
+    std::unique_ptr<Transcoder> trans(prefetcher.adopt(origpath));
+    if (!trans) {
+        trans.reset(new Transcoder(origpath));
+        if (!trans->open()) {
+            return -errno;
+        }
+    }
+
+    trans->set_client(caller()->uid);
+
+    if (params.pace > 0 && is_bulk_copier(caller()->pid)) {
+        Log(DEBUG) << "Reader of " << path << " is a bulk copy, not pacing.";
+        trans->set_bulk_reader(true);
     }
 
     /* Store transcoder in the fuse_file_info structure. */
@@ -239,12 +389,14 @@ int mp3fs_read(const char *path, char *buf, size_t size, off_t offset,
         return 0;
     }
 
-    ssize_t read = trans->read(buf, offset, size);
+    ssize_t read = trans->read(buf, offset, size, interrupted);
+    int read_errno = errno;
+    prefetcher.note_read(*trans);
 
     if (read >= 0) {
         return (int)read;
     } else {
-        return -errno;
+        return -read_errno;
     }
 }
 
@@ -275,22 +427,61 @@ int mp3fs_release(const char *path, struct fuse_file_info *fi) {
 
     Transcoder* trans = (Transcoder*)fi->fh;
     if (trans) {
-        delete trans;
+        trans->cancel();
+        reaper.push([trans] { delete trans; });
     }
 
     return 0;
 }
 
+void mp3fs_destroy(void*) {
+    // Stop background work while the objects it uses still exist.
+    prefetcher.stop();
+    Transcoder::stop_refining();
+    reaper.drain();
+}
+
 fuse_operations init_mp3fs_ops() {
     fuse_operations ops;
 
-    ops.getattr  = mp3fs_getattr;
-    ops.readlink = mp3fs_readlink;
-    ops.open     = mp3fs_open;
-    ops.read     = mp3fs_read;
-    ops.statfs   = mp3fs_statfs;
-    ops.release  = mp3fs_release;
-    ops.readdir  = mp3fs_readdir;
+    /*
+     * Metadata and data operations run on separate pools, if configured, so
+     * that a burst of one kind does not hold up the other.
+     */
+    ops.getattr  = [](const char* path, struct stat* stbuf) {
+        return run_on(metadata_pool(), [=] {
+            return mp3fs_getattr(path, stbuf);
+        });
+    };
+    ops.readlink = [](const char* path, char* buf, size_t size) {
+        return run_on(metadata_pool(), [=] {
+            return mp3fs_readlink(path, buf, size);
+        });
+    };
+    ops.open     = [](const char* path, struct fuse_file_info* fi) {
+        return run_on(data_pool(), [=] { return mp3fs_open(path, fi); });
+    };
+    ops.read     = [](const char* path, char* buf, size_t size, off_t offset,
+                      struct fuse_file_info* fi) {
+        return run_on(data_pool(), [=] {
+            return mp3fs_read(path, buf, size, offset, fi);
+        });
+    };
+    ops.statfs   = [](const char* path, struct statvfs* stbuf) {
+        return run_on(metadata_pool(), [=] {
+            return mp3fs_statfs(path, stbuf);
+        });
+    };
+    ops.release  = [](const char* path, struct fuse_file_info* fi) {
+        return run_on(data_pool(), [=] { return mp3fs_release(path, fi); });
+    };
+    ops.readdir  = [](const char* path, void* buf, fuse_fill_dir_t filler,
+                      off_t offset, struct fuse_file_info* fi) {
+        return run_on(metadata_pool(), [=] {
+            return mp3fs_readdir(path, buf, filler, offset, fi);
+        });
+    };
+    ops.destroy  = mp3fs_destroy;
 
     return ops;
 }
@@ -0,0 +1,265 @@
+/*
+ * Fast base64 decoder for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "base64_fast.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_FAST_X86 1
+#include <immintrin.h>
+#endif
+
+/* Value of each base64 character plus one, so 0 marks invalid ones. */
+static const unsigned char decode_table[256] = {
+    ['A'] = 1, ['B'] = 2, ['C'] = 3, ['D'] = 4, ['E'] = 5, ['F'] = 6,
+    ['G'] = 7, ['H'] = 8, ['I'] = 9, ['J'] = 10, ['K'] = 11, ['L'] = 12,
+    ['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16, ['Q'] = 17, ['R'] = 18,
+    ['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+    ['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30,
+    ['e'] = 31, ['f'] = 32, ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36,
+    ['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40, ['o'] = 41, ['p'] = 42,
+    ['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+    ['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54,
+    ['2'] = 55, ['3'] = 56, ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60,
+    ['8'] = 61, ['9'] = 62, ['+'] = 63, ['/'] = 64,
+};
+
+/*
+ * A kernel decodes whole blocks from the start of in, stopping before the
+ * first block that holds anything but base64 characters (such as padding),
+ * and returns the number of characters it decoded. It may write up to a
+ * block of output past the decoded data, but only where the caller has
+ * room for BASE64_DECODED_MAX(inlen) bytes.
+ */
+typedef size_t (*kernel_t)(const char* in, size_t inlen, char* out);
+
+static size_t decode_none(const char* in, size_t inlen, char* out) {
+    (void)in;
+    (void)inlen;
+    (void)out;
+    return 0;
+}
+
+#ifdef BASE64_FAST_X86
+/*
+ * Each character is mapped to its value by the range it is in. Characters
+ * in no range, including all bytes above 127 (negative in the signed
+ * compares), end the decoding. Pairs of 6-bit values are then joined into
+ * 12 bits, pairs of those into 24, and the 3 bytes of each are moved to the
+ * front in big endian order.
+ */
+#define RANGE_128(c, lo, hi) \
+    _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8((lo) - 1)), \
+                  _mm_cmpgt_epi8(_mm_set1_epi8((hi) + 1), c))
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(const char* in, size_t inlen, char* out) {
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                       14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0;
+    /* Stores write 16 bytes, 4 more than are decoded. */
+    for (; i + 24 <= inlen; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i upper = RANGE_128(c, 'A', 'Z');
+        __m128i lower = RANGE_128(c, 'a', 'z');
+        __m128i digit = RANGE_128(c, '0', '9');
+        __m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+        __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+        __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+            _mm_or_si128(_mm_or_si128(digit, plus), slash));
+        if (_mm_movemask_epi8(valid) != 0xffff) {
+            break;
+        }
+
+        __m128i shift = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                         _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+            _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62 - '+')),
+                             _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+        __m128i v = _mm_add_epi8(c, shift);
+
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        v = _mm_shuffle_epi8(v, pack);
+        _mm_storeu_si128((__m128i*)(out + i / 4 * 3), v);
+    }
+    return i;
+}
+
+#define RANGE_256(c, lo, hi) \
+    _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8((lo) - 1)), \
+                     _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), c))
+
+/* The shuffle works within 128-bit lanes, so the lanes are joined after. */
+__attribute__((target("avx2")))
+static size_t decode_avx2(const char* in, size_t inlen, char* out) {
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                          14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                          14, 13, 12, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t i = 0;
+    /* Stores write 32 bytes, 8 more than are decoded. */
+    for (; i + 48 <= inlen; i += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i upper = RANGE_256(c, 'A', 'Z');
+        __m256i lower = RANGE_256(c, 'a', 'z');
+        __m256i digit = RANGE_256(c, '0', '9');
+        __m256i plus = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('+'));
+        __m256i slash = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('/'));
+        __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower),
+            _mm256_or_si256(_mm256_or_si256(digit, plus), slash));
+        if (_mm256_movemask_epi8(valid) != -1) {
+            break;
+        }
+
+        __m256i shift = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+            _mm256_or_si256(
+                _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+                _mm256_or_si256(
+                    _mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')),
+                    _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')))));
+        __m256i v = _mm256_add_epi8(c, shift);
+
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, pack);
+        v = _mm256_permutevar8x32_epi32(v, join);
+        _mm256_storeu_si256((__m256i*)(out + i / 4 * 3), v);
+    }
+    return i;
+}
+#endif
+
+static kernel_t choose_kernel(const char** name) {
+#ifdef BASE64_FAST_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return decode_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        *name = "ssse3";
+        return decode_ssse3;
+    }
+#endif
+    *name = "generic";
+    return decode_none;
+}
+
+/*
+ * The kernel for this CPU, chosen on the first call. Threads that race on
+ * it choose the same kernel, so storing it needs no lock.
+ */
+static kernel_t kernel(const char** name) {
+#ifdef BASE64_FAST_X86
+    static kernel_t chosen;
+    static const char* chosen_name;
+    kernel_t k = __atomic_load_n(&chosen, __ATOMIC_ACQUIRE);
+    if (!k) {
+        k = choose_kernel(name);
+        __atomic_store_n(&chosen_name, *name, __ATOMIC_RELAXED);
+        __atomic_store_n(&chosen, k, __ATOMIC_RELEASE);
+        return k;
+    }
+    *name = __atomic_load_n(&chosen_name, __ATOMIC_RELAXED);
+    return k;
+#else
+    return choose_kernel(name);
+#endif
+}
+
+/*
+ * Decode the groups of in one at a time. Only the last group may have
+ * padding, of one or two characters.
+ */
+static bool decode_groups(const unsigned char* in, size_t inlen,
+                          unsigned char* out, size_t* outlen) {
+    size_t o = 0;
+    for (size_t i = 0; i < inlen; i += 4) {
+        bool last = i + 4 == inlen;
+        unsigned a = decode_table[in[i]];
+        unsigned b = decode_table[in[i + 1]];
+        unsigned c = decode_table[in[i + 2]];
+        unsigned d = decode_table[in[i + 3]];
+        if (!a || !b) {
+            return false;
+        }
+
+        unsigned bits = (a - 1) << 18 | (b - 1) << 12;
+        out[o++] = (unsigned char)(bits >> 16);
+        if (last && in[i + 2] == '=' && in[i + 3] == '=') {
+            break;
+        } else if (!c) {
+            return false;
+        }
+
+        bits |= (c - 1) << 6;
+        out[o++] = (unsigned char)(bits >> 8);
+        if (last && in[i + 3] == '=') {
+            break;
+        } else if (!d) {
+            return false;
+        }
+
+        bits |= d - 1;
+        out[o++] = (unsigned char)bits;
+    }
+
+    *outlen = o;
+    return true;
+}
+
+static bool decode_with(kernel_t kernel, const char* in, size_t inlen,
+                        char* out, size_t* outlen) {
+    if (inlen % 4 != 0) {
+        return false;
+    }
+
+    size_t done = kernel(in, inlen, out);
+    size_t rest;
+    if (!decode_groups((const unsigned char*)in + done, inlen - done,
+                       (unsigned char*)out + done / 4 * 3, &rest)) {
+        return false;
+    }
+
+    *outlen = done / 4 * 3 + rest;
+    return true;
+}
+
+bool base64_decode_fast(const char* in, size_t inlen, char* out,
+                        size_t* outlen) {
+    const char* name;
+    return decode_with(kernel(&name), in, inlen, out, outlen);
+}
+
+bool base64_decode_fast_generic(const char* in, size_t inlen, char* out,
+                                size_t* outlen) {
+    return decode_with(decode_none, in, inlen, out, outlen);
+}
+
+const char* base64_decode_fast_kernel(void) {
+    const char* name;
+    kernel(&name);
+    return name;
+}
@@ -0,0 +1,59 @@
+/*
+ * Fast base64 decoder header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef BASE64_FAST_H
+#define BASE64_FAST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Room needed to decode inlen characters of base64. */
+#define BASE64_DECODED_MAX(inlen) (((inlen) + 3) / 4 * 3)
+
+/*
+ * Decode inlen characters of base64 from in into out, which must have room
+ * for BASE64_DECODED_MAX(inlen) bytes, and set *outlen to the number of
+ * bytes decoded. Accepts the same input as base64_decode(): groups of four
+ * characters with no whitespace, padded with '=' at the end. Returns false
+ * if the input is not valid, in which case the contents of out are
+ * undefined.
+ *
+ * Blocks of input are decoded with vector instructions where the CPU
+ * supports them, and the rest one group at a time.
+ */
+bool base64_decode_fast(const char* in, size_t inlen, char* out,
+                        size_t* outlen);
+
+/* The same decoding done one group at a time, for reference. */
+bool base64_decode_fast_generic(const char* in, size_t inlen, char* out,
+                                size_t* outlen);
+
+/* Name of the vector kernel used by base64_decode_fast(), for diagnostics. */
+const char* base64_decode_fast_kernel(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -36,29 +36,45 @@
 #include <fuse.h>
 
 #include "codecs/coders.h"
+#include "codecs/source_reader.h"
 #include "logging.h"
 #include "mp3fs.h"
+#include "scheduler.h"
 
 /* Fuse operations struct */
 extern struct fuse_operations mp3fs_ops;
 
 struct mp3fs_params params = {
     .basepath        = NULL,
+    .adaptivequality = 0,
     .bitrate         = 128,
+    .datathreads     = 0,
     .debug           = 0,
 #ifdef HAVE_MP3
     .desttype        = "mp3",
 #endif
+    .encoders        = 0,
+    .executors       = 0,
     .gainmode        = 1,
     .gainref         = 89.0,
+    .hibernate       = 0,
+    .metathreads     = 0,
     .log_maxlevel    = "INFO",
     .log_stderr      = 0,
     .log_syslog      = 0,
     .logfile         = "",
+    .pace            = 0,
+    .prefetch        = 0,
     .quality         = 5,
+    .readahead       = 4096,
+    .resample        = 0,
+    .sourceio        = "pread",
     .statcachesize   = 0,
+    .uidweights      = "",
     .vbr             = 0,
+    .vbrstream       = 0,
     .crc             = ~0,
+    .pipeline        = 0,
 };
 
 enum {
@@ -70,16 +86,28 @@ enum {
 #define MP3FS_OPT(t, p, v) { t, offsetof(struct mp3fs_params, p), v }
 
 static struct fuse_opt mp3fs_opts[] = {
+    MP3FS_OPT("--adaptivequality",    adaptivequality, 1),
+    MP3FS_OPT("adaptivequality",      adaptivequality, 1),
     MP3FS_OPT("-b %u",                bitrate, 0),
     MP3FS_OPT("bitrate=%u",           bitrate, 0),
+    MP3FS_OPT("--datathreads=%u",     datathreads, 0),
+    MP3FS_OPT("datathreads=%u",       datathreads, 0),
     MP3FS_OPT("-d",                   debug, 1),
     MP3FS_OPT("debug",                debug, 1),
     MP3FS_OPT("--desttype=%s",        desttype, 0),
     MP3FS_OPT("desttype=%s",          desttype, 0),
+    MP3FS_OPT("--encoders=%u",        encoders, 0),
+    MP3FS_OPT("encoders=%u",          encoders, 0),
+    MP3FS_OPT("--executors=%u",       executors, 0),
+    MP3FS_OPT("executors=%u",         executors, 0),
     MP3FS_OPT("--gainmode=%d",        gainmode, 0),
     MP3FS_OPT("gainmode=%d",          gainmode, 0),
     MP3FS_OPT("--gainref=%f",         gainref, 0),
     MP3FS_OPT("gainref=%f",           gainref, 0),
+    MP3FS_OPT("--hibernate=%u",       hibernate, 0),
+    MP3FS_OPT("hibernate=%u",         hibernate, 0),
+    MP3FS_OPT("--metathreads=%u",     metathreads, 0),
+    MP3FS_OPT("metathreads=%u",       metathreads, 0),
     MP3FS_OPT("--log_maxlevel=%s",    log_maxlevel, 0),
     MP3FS_OPT("log_maxlevel=%s",      log_maxlevel, 0),
     MP3FS_OPT("--log_stderr",         log_stderr, 1),
@@ -88,14 +116,30 @@ static struct fuse_opt mp3fs_opts[] = {
     MP3FS_OPT("log_syslog",           log_syslog, 1),
     MP3FS_OPT("--logfile=%s",         logfile, 0),
     MP3FS_OPT("logfile=%s",           logfile, 0),
+    MP3FS_OPT("--pace=%u",            pace, 0),
+    MP3FS_OPT("pace=%u",              pace, 0),
+    MP3FS_OPT("--prefetch=%u",        prefetch, 0),
+    MP3FS_OPT("prefetch=%u",          prefetch, 0),
     MP3FS_OPT("--quality=%u",         quality, 0),
     MP3FS_OPT("quality=%u",           quality, 0),
+    MP3FS_OPT("--readahead=%u",       readahead, 0),
+    MP3FS_OPT("readahead=%u",         readahead, 0),
+    MP3FS_OPT("--resample",           resample, 1),
+    MP3FS_OPT("resample",             resample, 1),
+    MP3FS_OPT("--sourceio=%s",        sourceio, 0),
+    MP3FS_OPT("sourceio=%s",          sourceio, 0),
     MP3FS_OPT("--statcachesize=%u",   statcachesize, 0),
     MP3FS_OPT("statcachesize=%u",     statcachesize, 0),
+    MP3FS_OPT("--uidweights=%s",      uidweights, 0),
+    MP3FS_OPT("uidweights=%s",        uidweights, 0),
     MP3FS_OPT("--vbr",                vbr, 1),
     MP3FS_OPT("vbr",                  vbr, 1),
+    MP3FS_OPT("--vbrstream",          vbrstream, 1),
+    MP3FS_OPT("vbrstream",            vbrstream, 1),
     MP3FS_OPT("--nocrc",              crc, 0),
     MP3FS_OPT("nocrc",                crc, 0),
+    MP3FS_OPT("--pipeline",           pipeline, 1),
+    MP3FS_OPT("pipeline",             pipeline, 1),
 
     FUSE_OPT_KEY("-h",                KEY_HELP),
     FUSE_OPT_KEY("--help",            KEY_HELP),
@@ -112,10 +156,25 @@ void usage(char *name) {
 Mount IN_DIR on OUT_DIR, converting FLAC/Ogg Vorbis files to MP3 upon access.\n\
 \n\
 Encoding options:\n\
+    --adaptivequality, -oadaptivequality\n\
+                           when encoding falls behind the readers, use a\n\
+                           faster quality setting for newly opened files,\n\
+                           returning to --quality as the load drops\n\
     -b RATE, -obitrate=RATE\n\
                            encoding bitrate: Acceptable values for RATE\n\
                            include 96, 112, 128, 160, 192, 224, 256, and\n\
                            320; 128 is the default\n\
+    --encoders=N, -oencoders=N\n\
+                           maximum number of files encoded at the same time.\n\
+                           When more files need data, the ones whose\n\
+                           readers are closest to running out go first.\n\
+                           Defaults to the number of CPUs.\n\
+    --executors=N, -oexecutors=N\n\
+                           encode in a pool of N threads that take turns\n\
+                           on all open files a few frames at a time, so\n\
+                           progress does not depend on the number of FUSE\n\
+                           threads. By default (0), each read encodes in\n\
+                           its own thread.\n\
     --gainmode=<0,1,2>, -ogainmode=<0,1,2>\n\
                            what to do with ReplayGain tags:\n\
                            0 - ignore/passthrough, 1 - prefer album gain (default),\n\
@@ -123,6 +182,12 @@ Encoding options:\n\
     --gainref=REF, -ogainref=REF\n\
                            reference value to use for ReplayGain in \n\
                            decibels: defaults to 89 dB\n\
+    --hibernate=SECONDS, -ohibernate=SECONDS\n\
+                           free the encoder state and buffered data of open\n\
+                           files that have not been read for SECONDS. The\n\
+                           next read encodes the file again from the start\n\
+                           up to the requested position. Disabled (0) by\n\
+                           default.\n\
     --log_maxlevel=LEVEL, -olog_maxlevel=LEVEL\n\
                            maximum level of messages to log, either ERROR,\n\
                            INFO, or DEBUG. Defaults to INFO, and always set\n\
@@ -136,18 +201,79 @@ Encoding options:\n\
     --logfile=FILE, -ologfile=FILE\n\
                            file to output log messages to. By default, no\n\
                            file will be written.\n\
+    --pace=SECONDS, -opace=SECONDS\n\
+                           encode no more than SECONDS of audio ahead of\n\
+                           real-time playback for each reader, so tracks\n\
+                           that are skipped are not encoded in full. Reads\n\
+                           further ahead wait. Copy tools such as cp and\n\
+                           rsync are detected and always run at full speed.\n\
+                           Should be larger than the read-ahead of your\n\
+                           players. Disabled (0) by default.\n\
+    --prefetch=SECONDS, -oprefetch=SECONDS\n\
+                           once most of a file has been read in order,\n\
+                           encode the first SECONDS of audio of the next\n\
+                           file in the directory in the background, so the\n\
+                           next track starts without a stall. Disabled (0)\n\
+                           by default.\n\
     --quality=<0..9>, -oquality=<0..9>\n\
                            encoding quality: 0 is slowest, 9 is fastest;\n\
                            5 is the default\n\
+    --readahead=KB, -oreadahead=KB\n\
+                           have the kernel read up to KB kilobytes of each\n\
+                           source file ahead of the decoder, so slow disks\n\
+                           and network storage are read while encoding\n\
+                           goes on. Defaults to 4096; 0 leaves read-ahead\n\
+                           to the kernel's own heuristics.\n\
+    --resample, -oresample Bring sources at 88.2, 96, 176.4 or 192 kHz down\n\
+                           to 44.1 or 48 kHz before encoding, with a faster\n\
+                           filter than the encoder's own resampler. With\n\
+                           --pipeline, this runs on the decoding thread.\n\
+    --sourceio=<mmap,pread>, -osourceio=<mmap,pread>\n\
+                           how to read source files: pread (the default)\n\
+                           reads them in large chunks, mmap maps them into\n\
+                           memory and saves a copy. With mmap, a source\n\
+                           file truncated while it is being transcoded,\n\
+                           as when retagging in place, crashes mp3fs.\n\
     --statcachesize=SIZE, -ostatcachesize=SIZE\n\
                            Set the number of entries for the file stats\n\
                            cache.  Necessary for decent performance when\n\
-                           VBR is enabled.  Each entry takes 100-200 bytes.\n\
+                           VBR is enabled.  Each entry takes 100-200 bytes,\n\
+                           or up to about 1.2 KB with VBR.\n\
+    --uidweights=LIST, -ouidweights=LIST\n\
+                           Share encoders between users in proportion to\n\
+                           their weights. LIST is a comma separated list of\n\
+                           UID:WEIGHT[:MAX] entries, where MAX optionally\n\
+                           limits the encoders used by that user at once.\n\
+                           Unlisted users have weight 1 and no limit.\n\
     --vbr, -ovbr           Use variable bit rate encoding.  When set, the\n\
                            bit rate set with '-b' sets the maximum bit rate.\n\
                            Performance will be terrible unless the\n\
                            statcachesize is enabled.\n\
+    --vbrstream, -ovbrstream\n\
+                           With --vbr, serve audio as soon as it is encoded\n\
+                           instead of encoding the whole file first. Until\n\
+                           a file has been encoded once, its VBR header is\n\
+                           a placeholder, so players may show a wrong\n\
+                           duration. With statcachesize, the real header is\n\
+                           cached and used for later opens.\n\
     --nocrc, -onocrc       Disable adding a CRC in the extended header.\n\
+    --pipeline, -opipeline Decode each file in a separate thread, so that\n\
+                           decoding and encoding of a single file can run\n\
+                           in parallel on different cores.\n\
+\n\
+Threading options:\n\
+    --metathreads=N, -ometathreads=N\n\
+    --datathreads=N, -odatathreads=N\n\
+                           handle metadata operations (getattr, readdir,\n\
+                           readlink, statfs) and data operations (open,\n\
+                           read, release) on separate pools of N threads,\n\
+                           so directory listings do not wait behind\n\
+                           encoding and the reverse. By default (0), each\n\
+                           operation runs on the FUSE thread that got it.\n\
+                           The FUSE thread still waits for the pool, and\n\
+                           libfuse runs at most 10 threads, so with 10\n\
+                           operations pending the pools no longer keep\n\
+                           one kind from waiting behind the other.\n\
 \n\
 General options:\n\
     -h, --help             display this help and exit\n\
@@ -248,6 +374,21 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (!SourceReader::check_method(params.sourceio)) {
+        fprintf(stderr, "Invalid sourceio method: %s\n\n",
+                params.sourceio);
+        usage(argv[0]);
+        return 1;
+    }
+
+    Scheduler::shares_t shares;
+    if (!Scheduler::parse_shares(params.uidweights, shares)) {
+        fprintf(stderr, "Invalid uidweights list: %s\n\n",
+                params.uidweights);
+        usage(argv[0]);
+        return 1;
+    }
+
     /* Check for valid destination type. */
     if (!check_encoder(params.desttype)) {
         fprintf(stderr, "No encoder available for desttype: %s\n\n",
@@ -260,18 +401,32 @@ int main(int argc, char *argv[]) {
 
     Log(DEBUG) << "MP3FS options:" << std::endl
                << "basepath:       " << params.basepath << std::endl
+               << "adaptivequality: " << params.adaptivequality << std::endl
                << "bitrate:        " << params.bitrate << std::endl
+               << "datathreads:    " << params.datathreads << std::endl
                << "desttype:       " << params.desttype << std::endl
+               << "encoders:       " << params.encoders << std::endl
+               << "executors:      " << params.executors << std::endl
                << "gainmode:       " << params.gainmode << std::endl
                << "gainref:        " << params.gainref << std::endl
+               << "hibernate:      " << params.hibernate << std::endl
+               << "metathreads:    " << params.metathreads << std::endl
                << "log_maxlevel:   " << params.log_maxlevel << std::endl
                << "log_stderr:     " << params.log_stderr << std::endl
                << "log_syslog:     " << params.log_syslog << std::endl
                << "logfile:        " << params.logfile << std::endl
+               << "pace:           " << params.pace << std::endl
+               << "prefetch:       " << params.prefetch << std::endl
                << "quality:        " << params.quality << std::endl
+               << "readahead:      " << params.readahead << std::endl
+               << "resample:       " << params.resample << std::endl
+               << "sourceio:       " << params.sourceio << std::endl
                << "statcachesize:  " << params.statcachesize << std::endl
+               << "uidweights:     " << params.uidweights << std::endl
                << "vbr:            " << params.vbr << std::endl
-               << "crc:            " << params.crc;
+               << "vbrstream:      " << params.vbrstream << std::endl
+               << "crc:            " << params.crc << std::endl
+               << "pipeline:       " << params.pipeline;
 
     // start FUSE
     ret = fuse_main(args.argc, args.argv, &mp3fs_ops, NULL);
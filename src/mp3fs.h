@@ -25,19 +25,33 @@
 /* Global program parameters */
 extern struct mp3fs_params {
     const char *basepath;
+    int adaptivequality;
     unsigned int bitrate;
+    unsigned int datathreads;
     int debug;
     const char* desttype;
+    unsigned int encoders;
+    unsigned int executors;
     int gainmode;
     float gainref;
+    unsigned int hibernate;
+    unsigned int metathreads;
     const char* log_maxlevel;
     int log_stderr;
     int log_syslog;
     const char* logfile;
+    unsigned int pace;
+    unsigned int prefetch;
     unsigned int quality;
+    unsigned int readahead;
+    int resample;
+    const char* sourceio;
     unsigned int statcachesize;
+    const char* uidweights;
     int vbr;
+    int vbrstream;
     int crc;
+    int pipeline;
 } params;
 
 #endif  // MP3FS_MP3FS_H
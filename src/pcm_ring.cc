@@ -0,0 +1,168 @@
+/*
+ * PCM block ring buffer source for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "pcm_ring.h"
+
+#include <algorithm>
+
+PcmRing::PcmRing(size_t slots, int channels) :
+slots_(slots), channels_(channels), head_(0), tail_(0), closed_(false),
+producer_waiting_(false), consumer_waiting_(false) {
+    for (Block& block : slots_) {
+        block.channels.resize(channels_);
+        block.float_channels.resize(channels_);
+    }
+}
+
+int PcmRing::encode_pcm_data(const int32_t* const data[], int numsamples,
+                             int sample_size) {
+    Block* block = claim();
+    if (!block) {
+        return 0;
+    }
+
+    block->status = 0;
+    block->numsamples = numsamples;
+    block->floating = false;
+    block->sample_size = sample_size;
+    for (int channel = 0; channel < channels_; ++channel) {
+        block->channels[channel].assign(data[channel],
+                                        data[channel] + numsamples);
+    }
+
+    publish();
+
+    return 0;
+}
+
+int PcmRing::encode_pcm_float(const float* const data[], int numsamples) {
+    Block* block = claim();
+    if (!block) {
+        return 0;
+    }
+
+    block->status = 0;
+    block->numsamples = numsamples;
+    block->floating = true;
+    for (int channel = 0; channel < channels_; ++channel) {
+        block->float_channels[channel].assign(data[channel],
+                                              data[channel] + numsamples);
+    }
+
+    publish();
+
+    return 0;
+}
+
+void PcmRing::push_status(int status) {
+    Block* block = claim();
+    if (!block) {
+        return;
+    }
+
+    block->status = status;
+    block->numsamples = 0;
+
+    publish();
+}
+
+int PcmRing::pop(PcmSink* sink) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    park(consumer_waiting_, [&] {
+        return head_.load(std::memory_order_acquire) != tail;
+    });
+    if (head_.load(std::memory_order_acquire) == tail) {
+        return -1;
+    }
+
+    Block& block = slots_[tail % slots_.size()];
+    int status = block.status;
+    if (status == 0 && block.floating) {
+        std::vector<const float*> data(channels_);
+        for (int channel = 0; channel < channels_; ++channel) {
+            data[channel] = block.float_channels[channel].data();
+        }
+        if (sink->encode_pcm_float(data.data(), block.numsamples) == -1) {
+            status = -1;
+        }
+    } else if (status == 0) {
+        std::vector<const int32_t*> data(channels_);
+        for (int channel = 0; channel < channels_; ++channel) {
+            data[channel] = block.channels[channel].data();
+        }
+        if (sink->encode_pcm_data(data.data(), block.numsamples,
+                                  block.sample_size) == -1) {
+            status = -1;
+        }
+    }
+
+    tail_.store(tail + 1);
+    wake(producer_waiting_);
+
+    return status;
+}
+
+void PcmRing::close() {
+    closed_ = true;
+
+    std::lock_guard<std::mutex> l(mutex_);
+    cond_.notify_all();
+}
+
+PcmRing::Block* PcmRing::claim() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    park(producer_waiting_, [&] {
+        return head - tail_.load(std::memory_order_acquire) < slots_.size();
+    });
+    if (closed_) {
+        return nullptr;
+    }
+
+    return &slots_[head % slots_.size()];
+}
+
+void PcmRing::publish() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1);
+    wake(consumer_waiting_);
+}
+
+/*
+ * The waiting flag is set before the condition is checked again under the
+ * mutex, and the other side stores its index before testing the flag, so a
+ * wakeup cannot be lost between the two.
+ */
+template <typename Pred>
+void PcmRing::park(std::atomic<bool>& waiting, Pred ready) {
+    if (ready() || closed_) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> l(mutex_);
+    waiting = true;
+    cond_.wait(l, [&] { return ready() || closed_; });
+    waiting = false;
+}
+
+void PcmRing::wake(const std::atomic<bool>& waiting) {
+    if (waiting) {
+        std::lock_guard<std::mutex> l(mutex_);
+        cond_.notify_all();
+    }
+}
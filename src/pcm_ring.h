@@ -0,0 +1,111 @@
+/*
+ * PCM block ring buffer header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef PCM_RING_H
+#define PCM_RING_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "codecs/coders.h"
+
+/*
+ * Bounded single-producer single-consumer ring of PCM blocks, each holding
+ * either integer or float data as it was given. The producer
+ * (a decoder thread) writes blocks through the PcmSink interface, and the
+ * consumer (the encoding thread) drains them into another PcmSink with pop().
+ *
+ * The slot indices are only ever advanced by one side each, so the common
+ * case needs no locking. A side only takes the mutex when it has to sleep
+ * because the ring is full or empty, or when it must wake the other side.
+ */
+class PcmRing : public PcmSink {
+public:
+    PcmRing(size_t slots, int channels);
+    PcmRing(const PcmRing&)            = delete;
+    PcmRing& operator=(const PcmRing&) = delete;
+
+    /**
+     * Copy a block of PCM data into the ring, waiting for a free slot if
+     * needed. Once the ring is closed the data is silently dropped.
+     */
+    int encode_pcm_data(const int32_t* const data[], int numsamples,
+                        int sample_size);
+    int encode_pcm_float(const float* const data[], int numsamples);
+
+    /**
+     * Queue the final status of the decoder: 1 for end of stream or -1 for
+     * an error. This must be the last thing the producer pushes.
+     */
+    void push_status(int status);
+
+    /**
+     * Wait for the next block and pass it on to the given sink. Returns 0
+     * if a block of data was passed on, 1 at end of stream, and -1 on error
+     * or if the ring was closed.
+     */
+    int pop(PcmSink* sink);
+
+    /** Wake up both sides and make them give up. */
+    void close();
+
+    bool closed() const { return closed_; }
+
+private:
+    struct Block {
+        int status;
+        int numsamples;
+        // Which of the two arrays holds the data.
+        bool floating;
+        int sample_size;
+        std::vector<std::vector<int32_t>> channels;
+        std::vector<std::vector<float>> float_channels;
+    };
+
+    /** Claim the next free slot for writing, or nullptr if closed. */
+    Block* claim();
+
+    /** Publish the slot returned by claim() to the consumer. */
+    void publish();
+
+    /** Sleep until ready() returns true or the ring is closed. */
+    template <typename Pred>
+    void park(std::atomic<bool>& waiting, Pred ready);
+
+    /** Wake the other side if it is sleeping on the given flag. */
+    void wake(const std::atomic<bool>& waiting);
+
+    std::vector<Block> slots_;
+    const int channels_;
+    std::atomic<size_t> head_;
+    std::atomic<size_t> tail_;
+    std::atomic<bool> closed_;
+
+    std::atomic<bool> producer_waiting_;
+    std::atomic<bool> consumer_waiting_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+#endif
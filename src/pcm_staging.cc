@@ -0,0 +1,135 @@
+/*
+ * PCM staging buffer source for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "pcm_staging.h"
+
+#include <algorithm>
+
+PcmStaging::PcmStaging(PcmSink* sink, int channels) :
+sink_(sink), channels_(channels), staged_(channels), staged_float_(channels),
+staged_samples_(0), floating_(false), sample_size_(0) {}
+
+int PcmStaging::encode_pcm_data(const int32_t* const data[], int numsamples,
+                                int sample_size) {
+    if (set_format(false, sample_size) == -1) {
+        return -1;
+    }
+    return stage(staged_, data, numsamples);
+}
+
+int PcmStaging::encode_pcm_float(const float* const data[], int numsamples) {
+    if (set_format(true, 0) == -1) {
+        return -1;
+    }
+    return stage(staged_float_, data, numsamples);
+}
+
+int PcmStaging::flush() {
+    if (staged_samples_ == 0) {
+        return 0;
+    }
+
+    int count = staged_samples_;
+    staged_samples_ = 0;
+    if (floating_) {
+        return forward(channel_pointers(staged_float_).data(), 0, count);
+    } else {
+        return forward(channel_pointers(staged_).data(), 0, count);
+    }
+}
+
+/* Pass on staged data in the old format before taking data in a new one. */
+int PcmStaging::set_format(bool floating, int sample_size) {
+    if (floating != floating_ || sample_size != sample_size_) {
+        if (flush() == -1) {
+            return -1;
+        }
+        floating_ = floating;
+        sample_size_ = sample_size;
+    }
+    return 0;
+}
+
+/*
+ * Stage the given data. Whole blocks are passed straight through from the
+ * caller's arrays when nothing is staged, so large inputs are not copied.
+ */
+template <typename T>
+int PcmStaging::stage(std::vector<std::vector<T>>& staged,
+                      const T* const data[], int numsamples) {
+    int offset = 0;
+    while (offset < numsamples) {
+        if (staged_samples_ == 0 && numsamples - offset >= block_samples) {
+            int count = (numsamples - offset) / block_samples * block_samples;
+            if (forward(data, offset, count) == -1) {
+                return -1;
+            }
+            offset += count;
+            continue;
+        }
+
+        int count = std::min(numsamples - offset,
+                             block_samples - staged_samples_);
+        for (int channel = 0; channel < channels_; ++channel) {
+            // Allocated on first use, as most streams only use one format.
+            staged[channel].resize(block_samples);
+            std::copy(data[channel] + offset, data[channel] + offset + count,
+                      staged[channel].begin() + staged_samples_);
+        }
+        staged_samples_ += count;
+        offset += count;
+
+        if (staged_samples_ == block_samples && flush() == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+template <typename T>
+std::vector<const T*> PcmStaging::channel_pointers(
+        const std::vector<std::vector<T>>& staged) const {
+    std::vector<const T*> data(channels_);
+    for (int channel = 0; channel < channels_; ++channel) {
+        data[channel] = staged[channel].data();
+    }
+    return data;
+}
+
+int PcmStaging::forward(const int32_t* const data[], int offset,
+                        int numsamples) {
+    std::vector<const int32_t*> shifted(channels_);
+    for (int channel = 0; channel < channels_; ++channel) {
+        shifted[channel] = data[channel] + offset;
+    }
+
+    return sink_->encode_pcm_data(shifted.data(), numsamples, sample_size_);
+}
+
+int PcmStaging::forward(const float* const data[], int offset,
+                        int numsamples) {
+    std::vector<const float*> shifted(channels_);
+    for (int channel = 0; channel < channels_; ++channel) {
+        shifted[channel] = data[channel] + offset;
+    }
+
+    return sink_->encode_pcm_float(shifted.data(), numsamples);
+}
@@ -0,0 +1,77 @@
+/*
+ * PCM staging buffer header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef PCM_STAGING_H
+#define PCM_STAGING_H
+
+#include <cstdint>
+#include <vector>
+
+#include "codecs/coders.h"
+
+/*
+ * Collects the small blocks of PCM data produced by decoders (as little as
+ * 192 samples for some FLAC files) into large blocks before passing them on
+ * to the next sink, so that per-call overhead in the encoder is paid rarely.
+ */
+class PcmStaging : public PcmSink {
+public:
+    /* Samples per block passed on; a multiple of the MP3 frame size. */
+    static const int block_samples = 8 * 1152;
+
+    PcmStaging(PcmSink* sink, int channels);
+
+    int encode_pcm_data(const int32_t* const data[], int numsamples,
+                        int sample_size);
+    int encode_pcm_float(const float* const data[], int numsamples);
+
+    /**
+     * Pass on any staged data, even if it does not fill a block. This must
+     * be called at the end of the stream.
+     */
+    int flush();
+
+private:
+    /** Switch to the given data format, flushing data in the old one. */
+    int set_format(bool floating, int sample_size);
+
+    template <typename T>
+    int stage(std::vector<std::vector<T>>& staged, const T* const data[],
+              int numsamples);
+
+    template <typename T>
+    std::vector<const T*> channel_pointers(
+        const std::vector<std::vector<T>>& staged) const;
+
+    /** Pass on numsamples samples starting at offset in data. */
+    int forward(const int32_t* const data[], int offset, int numsamples);
+    int forward(const float* const data[], int offset, int numsamples);
+
+    PcmSink* sink_;
+    const int channels_;
+    std::vector<std::vector<int32_t>> staged_;
+    std::vector<std::vector<float>> staged_float_;
+    int staged_samples_;
+    // Format of the staged data.
+    bool floating_;
+    int sample_size_;
+};
+
+#endif
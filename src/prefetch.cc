@@ -0,0 +1,208 @@
+/*
+ * Next track prefetching source for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "prefetch.h"
+
+#include <algorithm>
+
+#include "logging.h"
+#include "mp3fs.h"
+
+namespace {
+
+/* The path of a directory without trailing slashes. */
+std::string trim_slashes(const std::string& path) {
+    size_t end = path.find_last_not_of('/');
+    return end == std::string::npos ? "" : path.substr(0, end + 1);
+}
+
+/* Number of directory listings remembered. */
+const size_t max_listings = 8;
+
+/* Number of files remembered as having triggered a prefetch. */
+const size_t max_triggered = 16;
+
+/* Number of prefetched files kept waiting to be opened. */
+const size_t pool_size = 2;
+
+/* Part of a file that must be read sequentially to prefetch the next one. */
+const double prefetch_fraction = 0.75;
+
+/* Amount encoded between checks whether the file has been opened. */
+const size_t prefetch_chunk = 64 * 1024;
+
+}
+
+void Prefetcher::note_listing(const std::string& path,
+                              std::vector<std::string> names) {
+    std::string dir = trim_slashes(path);
+    std::sort(names.begin(), names.end());
+
+    std::lock_guard<std::mutex> l(mutex_);
+    for (auto p = listings_.begin(); p != listings_.end(); ++p) {
+        if (p->first == dir) {
+            listings_.erase(p);
+            break;
+        }
+    }
+    listings_.emplace_front(dir, std::move(names));
+    if (listings_.size() > max_listings) {
+        listings_.pop_back();
+    }
+}
+
+void Prefetcher::note_read(Transcoder& trans) {
+    if (params.prefetch == 0 ||
+        trans.sequential_fraction() < prefetch_fraction) {
+        return;
+    }
+
+    // Listings hold the names of original files, as does the Transcoder.
+    const std::string& filename = trans.get_filename();
+
+    std::lock_guard<std::mutex> l(mutex_);
+    if (stopping_ || std::find(triggered_.begin(), triggered_.end(),
+                               filename) != triggered_.end()) {
+        return;
+    }
+    triggered_.push_back(filename);
+    if (triggered_.size() > max_triggered) {
+        triggered_.pop_front();
+    }
+
+    std::string next = next_sibling(filename);
+    if (next.empty() || find(next) != pool_.end()) {
+        return;
+    }
+
+    // Make room by dropping the oldest files that are not being encoded.
+    while (pool_.size() >= pool_size) {
+        auto victim = std::find_if(pool_.rbegin(), pool_.rend(),
+                                   [](const Entry& e) { return !e.busy; });
+        if (victim == pool_.rend()) {
+            return;
+        }
+        Log(DEBUG) << "Dropping unused prefetch of " << victim->filename;
+        pool_.erase(std::next(victim).base());
+    }
+
+    Log(DEBUG) << "Prefetching " << next << " after reading " << filename;
+
+    pool_.push_front(Entry{next, nullptr, true, false});
+    if (!queue_) {
+        queue_.reset(new WorkQueue(1));
+    }
+    queue_->push([this, next] { run(next); });
+}
+
+Transcoder* Prefetcher::adopt(const std::string& filename) {
+    std::lock_guard<std::mutex> l(mutex_);
+    auto entry = find(filename);
+    if (entry == pool_.end()) {
+        return nullptr;
+    } else if (entry->busy) {
+        Log(DEBUG) << "Prefetch of " << filename << " still running, "
+            "opening it afresh.";
+        entry->wanted = true;
+        return nullptr;
+    }
+
+    Log(DEBUG) << "Using prefetched transcoder for " << filename;
+
+    Transcoder* trans = entry->trans.release();
+    pool_.erase(entry);
+    return trans;
+}
+
+void Prefetcher::stop() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stopping_ = true;
+    }
+
+    // Waits for a running job, which stops at its next chunk.
+    queue_.reset(nullptr);
+
+    std::lock_guard<std::mutex> l(mutex_);
+    pool_.clear();
+}
+
+/*
+ * Encode the first prefetch seconds of the file in chunks, so that the job
+ * stops soon after an open of the file gives up on it.
+ */
+void Prefetcher::run(const std::string& filename) {
+    std::unique_ptr<Transcoder> trans(new Transcoder(filename));
+    bool ok = trans->open();
+
+    size_t target = (size_t)params.prefetch * params.bitrate * 1000 / 8;
+    size_t done = 0;
+    while (ok && done < target) {
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            if (stopping_ || find(filename)->wanted) {
+                break;
+            }
+        }
+        done = std::min(done + prefetch_chunk, target);
+        ok = trans->prefetch(done);
+    }
+
+    std::lock_guard<std::mutex> l(mutex_);
+    auto entry = find(filename);
+    if (ok && !entry->wanted) {
+        entry->trans = std::move(trans);
+        entry->busy = false;
+    } else {
+        if (!ok) {
+            Log(DEBUG) << "Prefetch of " << filename << " failed.";
+        }
+        pool_.erase(entry);
+    }
+}
+
+std::string Prefetcher::next_sibling(const std::string& filename) const {
+    size_t slash = filename.rfind('/');
+    if (slash == std::string::npos) {
+        return "";
+    }
+    std::string dir = trim_slashes(filename.substr(0, slash));
+    std::string name = filename.substr(slash + 1);
+
+    for (const auto& listing : listings_) {
+        if (listing.first == dir) {
+            const std::vector<std::string>& names = listing.second;
+            auto next = std::upper_bound(names.begin(), names.end(), name);
+            if (next != names.end()) {
+                return dir + "/" + *next;
+            }
+            break;
+        }
+    }
+
+    return "";
+}
+
+std::list<Prefetcher::Entry>::iterator Prefetcher::find(
+        const std::string& filename) {
+    return std::find_if(pool_.begin(), pool_.end(), [&](const Entry& e) {
+        return e.filename == filename;
+    });
+}
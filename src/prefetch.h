@@ -0,0 +1,98 @@
+/*
+ * Next track prefetching header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "transcode.h"
+#include "work_queue.h"
+
+/*
+ * Starts encoding the next track of an album before the player opens it.
+ * Directory listings seen by readdir give the files of each directory, in
+ * name order, which is how players order tracks. When a file has been read
+ * sequentially for most of its length, the next file in its directory is
+ * opened and the beginning encoded at background priority. The result waits
+ * in a small pool, from which the next open of that file takes it.
+ */
+class Prefetcher {
+public:
+    Prefetcher() : stopping_(false) {}
+    ~Prefetcher() { stop(); }
+    Prefetcher(const Prefetcher&)            = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    /**
+     * Remember the names of the original files that readdir found in a
+     * directory and that can be transcoded.
+     */
+    void note_listing(const std::string& dir, std::vector<std::string> names);
+
+    /** Called after each read through trans. */
+    void note_read(Transcoder& trans);
+
+    /**
+     * Take the prefetched Transcoder for the original file out of the pool,
+     * or return nullptr if there is none. One that is still encoding is
+     * abandoned rather than waited for, since its chunks run at background
+     * priority and may wait long for a slot. The caller owns the result.
+     */
+    Transcoder* adopt(const std::string& filename);
+
+    /** Stop prefetching and free the pool. */
+    void stop();
+
+private:
+    struct Entry {
+        std::string filename;
+        std::unique_ptr<Transcoder> trans;
+        // Whether the prefetch job is still using trans, and whether an open
+        // gave up on it, so the job should stop and drop it.
+        bool busy;
+        bool wanted;
+    };
+
+    /** Body of the prefetch job for the file. */
+    void run(const std::string& filename);
+
+    /** The file after the given one in its directory, or "" if unknown. */
+    std::string next_sibling(const std::string& filename) const;
+
+    std::list<Entry>::iterator find(const std::string& filename);
+
+    std::mutex mutex_;
+    // Recent directory listings, the newest first, with sorted file names.
+    std::list<std::pair<std::string, std::vector<std::string>>> listings_;
+    // Recent files whose next file was prefetched already.
+    std::deque<std::string> triggered_;
+    std::list<Entry> pool_;
+    std::unique_ptr<WorkQueue> queue_;
+    bool stopping_;
+};
+
+#endif
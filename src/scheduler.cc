@@ -0,0 +1,300 @@
+/*
+ * Transcoding scheduler source for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "mp3fs.h"
+
+namespace {
+
+/* Time over which the load measure forgets old slots. */
+const std::chrono::seconds load_time_constant(10);
+
+/* The weight that remains of a load sample taken the given time ago. */
+double load_decay(Scheduler::clock::duration age) {
+    return std::exp(-std::chrono::duration<double>(age).count() /
+                    std::chrono::duration<double>(load_time_constant).count());
+}
+
+}
+
+bool Scheduler::parse_shares(const char* spec, shares_t& shares) {
+    std::string list(spec ? spec : "");
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string entry = list.substr(pos, end - pos);
+        pos = end + 1;
+
+        char* p;
+        const char* c = entry.c_str();
+        long uid = std::strtol(c, &p, 10);
+        if (p == c || *p != ':' || uid < 0) {
+            return false;
+        }
+        c = p + 1;
+        Share share = {std::strtod(c, &p), 0};
+        if (p == c || !(share.weight > 0)) {
+            return false;
+        }
+        if (*p == ':') {
+            c = p + 1;
+            share.max_running = (unsigned)std::strtoul(c, &p, 10);
+            if (p == c) {
+                return false;
+            }
+        }
+        if (*p != '\0') {
+            return false;
+        }
+        shares[uid] = share;
+    }
+
+    return true;
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    for (std::thread& executor : executors_) {
+        executor.join();
+    }
+}
+
+void Scheduler::acquire(clock::time_point deadline, client_t client) {
+    std::unique_lock<std::mutex> l(mutex_);
+
+    auto ticket = enqueue(deadline, client, nullptr);
+    cond_.wait(l, [&] {
+        return running_ < max_running() && next_ticket() == ticket;
+    });
+    grant(ticket);
+}
+
+void Scheduler::release(client_t client, clock::duration used) {
+    std::lock_guard<std::mutex> l(mutex_);
+    charge(client, used);
+}
+
+void Scheduler::submit(Task* task, clock::time_point deadline,
+                       client_t client) {
+    std::lock_guard<std::mutex> l(mutex_);
+    if (executors_.empty()) {
+        for (unsigned i = 0; i < std::max(params.executors, 1u); ++i) {
+            executors_.emplace_back(&Scheduler::run_executor, this);
+        }
+    }
+
+    auto running = running_tasks_.find(task);
+    if (running != running_tasks_.end()) {
+        running->second.requeue = !running->second.withdrawn;
+        running->second.deadline = deadline;
+        running->second.client = client;
+        return;
+    }
+
+    enqueue(deadline, client, task);
+    cond_.notify_all();
+}
+
+void Scheduler::withdraw(Task* task) {
+    std::unique_lock<std::mutex> l(mutex_);
+    auto running = running_tasks_.find(task);
+    if (running != running_tasks_.end()) {
+        running->second.requeue = false;
+        running->second.withdrawn = true;
+    }
+    cond_.wait(l, [&] { return running_tasks_.count(task) == 0; });
+
+    for (auto t = waiting_.begin(); t != waiting_.end();) {
+        if (t->task == task) {
+            --clients_[t->client].waiting;
+            t = waiting_.erase(t);
+        } else {
+            ++t;
+        }
+    }
+
+    cond_.notify_all();
+}
+
+void Scheduler::run_executor() {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (true) {
+        std::list<Ticket>::iterator ticket;
+        cond_.wait(l, [&] {
+            return stopping_ || (running_ < max_running() &&
+                                 (ticket = next_ticket()) != waiting_.end() &&
+                                 ticket->task);
+        });
+        if (stopping_) {
+            return;
+        }
+
+        Task* task = ticket->task;
+        client_t client = ticket->client;
+        grant(ticket);
+        running_tasks_[task] = Running{false, false, clock::time_point(),
+                                       client};
+
+        l.unlock();
+        clock::time_point start = clock::now();
+        task->step();
+        clock::duration used = clock::now() - start;
+        l.lock();
+
+        auto running = running_tasks_.find(task);
+        if (running->second.requeue) {
+            enqueue(running->second.deadline, running->second.client, task);
+        }
+        running_tasks_.erase(running);
+        charge(client, used);
+    }
+}
+
+std::list<Scheduler::Ticket>::iterator Scheduler::enqueue(
+        clock::time_point deadline, client_t client, Task* task) {
+    /*
+     * A client that was idle is brought forward to the current virtual
+     * time, so that it cannot save up credit while it is not running.
+     * Clients are few (one per user), so they are never removed.
+     */
+    auto c = clients_.insert({client, Client{vtime_, 0, 0}}).first;
+    if (c->second.running == 0 && c->second.waiting == 0) {
+        c->second.vtime = std::max(c->second.vtime, vtime_);
+    }
+    ++c->second.waiting;
+
+    return waiting_.insert(waiting_.end(),
+                           Ticket{next_ticket_++, deadline, client, task});
+}
+
+void Scheduler::grant(std::list<Ticket>::iterator ticket) {
+    Client& c = clients_[ticket->client];
+    if (ticket->client != background_client) {
+        update_load(clock::now() > ticket->deadline);
+    }
+    --c.waiting;
+    ++c.running;
+    ++running_;
+    vtime_ = std::max(vtime_, c.vtime);
+    waiting_.erase(ticket);
+
+    // Another slot may still be free for the next waiter in line.
+    cond_.notify_all();
+}
+
+void Scheduler::charge(client_t client, clock::duration used) {
+    --running_;
+
+    auto c = clients_.find(client);
+    --c->second.running;
+    c->second.vtime +=
+        std::chrono::duration<double>(used).count() / share(client).weight;
+
+    cond_.notify_all();
+}
+
+double Scheduler::load() {
+    std::lock_guard<std::mutex> l(mutex_);
+    return load_ * load_decay(clock::now() - load_time_);
+}
+
+/*
+ * Each sample moves the load towards 1 if late or 0 if on time, by an amount
+ * that grows with the time since the previous sample, so the result does not
+ * depend on how finely work is sliced.
+ */
+void Scheduler::update_load(bool late) {
+    clock::time_point now = clock::now();
+    double decay = load_decay(now - load_time_);
+    load_ = load_ * decay + (late ? 1 - decay : 0);
+    load_time_ = now;
+}
+
+/*
+ * Choose among waiters whose client is below its slot limit. Clients are
+ * ordered with background work last, then by encoding time received for
+ * their weight. Within a client, the earliest deadline goes first, and
+ * ties go to the earliest arrival.
+ */
+std::list<Scheduler::Ticket>::iterator Scheduler::next_ticket() {
+    auto best = waiting_.end();
+    for (auto t = waiting_.begin(); t != waiting_.end(); ++t) {
+        const Client& c = clients_[t->client];
+        unsigned limit = share(t->client).max_running;
+        if (limit > 0 && c.running >= limit) {
+            continue;
+        }
+        if (best == waiting_.end()) {
+            best = t;
+            continue;
+        }
+
+        const Client& b = clients_[best->client];
+        bool t_bg = t->client == background_client;
+        bool best_bg = best->client == background_client;
+        if (t_bg != best_bg) {
+            if (!t_bg) best = t;
+        } else if (c.vtime != b.vtime) {
+            if (c.vtime < b.vtime) best = t;
+        } else if (t->deadline != best->deadline) {
+            if (t->deadline < best->deadline) best = t;
+        } else if (t->seq < best->seq) {
+            best = t;
+        }
+    }
+
+    return best;
+}
+
+Scheduler::Share Scheduler::share(client_t client) {
+    if (!shares_parsed_) {
+        parse_shares(params.uidweights, shares_);
+        shares_parsed_ = true;
+    }
+
+    auto s = shares_.find(client);
+    if (s != shares_.end()) {
+        return s->second;
+    }
+    return Share{1.0, 0};
+}
+
+unsigned Scheduler::max_running() {
+    if (params.encoders > 0) {
+        return params.encoders;
+    }
+
+    unsigned cpus = std::thread::hardware_concurrency();
+    return cpus > 0 ? cpus : 1;
+}
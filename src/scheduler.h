@@ -0,0 +1,206 @@
+/*
+ * Transcoding scheduler header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Limits the number of threads encoding at the same time, and decides who
+ * gets a free encoding slot. Work is queued per client (the uid of the
+ * process that opened the file), and clients are served by weighted fair
+ * queueing: the client that has received the least encoding time for its
+ * weight goes next. Within a client, waiters are served earliest deadline
+ * first. Background work only runs when no client is waiting.
+ *
+ * Transcoders hold a slot only for a short slice of work at a time, so an
+ * urgent stream never waits for long behind one that is far ahead of its
+ * listener, and one client's bulk job cannot starve the others.
+ *
+ * Work can be done in two ways. A thread can hold a Slot while it works
+ * itself, or, with the executors parameter, a Task can be submitted to be
+ * run one slice at a time by a fixed pool of executor threads. The latter
+ * lets any number of open files make progress without a thread each.
+ */
+class Scheduler {
+public:
+    typedef std::chrono::steady_clock clock;
+    typedef int64_t client_t;
+
+    /* Client used for work that nobody is waiting for. */
+    static const client_t background_client = -1;
+
+    /* Scheduling weight and maximum slots (0 for no limit) of a client. */
+    struct Share {
+        double weight;
+        unsigned max_running;
+    };
+    typedef std::map<client_t, Share> shares_t;
+
+    /**
+     * Parse a list of client shares in the form UID:WEIGHT[:MAXENCODERS],
+     * separated by commas, as given in the uidweights parameter. Returns
+     * false if the list is malformed.
+     */
+    static bool parse_shares(const char* spec, shares_t& shares);
+
+    /* Work that executor threads can run in short slices. */
+    class Task {
+    public:
+        virtual ~Task() {}
+
+        /**
+         * Do a short slice of work, and submit() the task again if there
+         * is more to do.
+         */
+        virtual void step() = 0;
+    };
+
+    Scheduler() :
+    running_(0), vtime_(0), next_ticket_(0), shares_parsed_(false), load_(0),
+    load_time_(clock::now()), stopping_(false) {}
+    ~Scheduler();
+    Scheduler(const Scheduler&)            = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    /**
+     * Return how far encoding is falling behind demand, from 0 to 1: the
+     * fraction of recent slots for user work that were only handed out after
+     * their deadline had passed. Recent slots count the most, and the value
+     * decays to 0 while nothing is waiting.
+     */
+    double load();
+
+    /**
+     * Queue the task to have step() called by an executor thread when the
+     * fair queueing order gives it a slot. Starts the executor threads if
+     * needed. A task must not be queued more than once at a time. A task
+     * that submits itself from step() is only queued once step() has
+     * returned, so no two executors ever run the same task.
+     */
+    void submit(Task* task, clock::time_point deadline, client_t client);
+
+    /**
+     * Remove the task from the queue, first waiting for it to finish if it
+     * is running. A running task is not queued again, even if it submits
+     * itself. After this, the task may be destroyed.
+     */
+    void withdraw(Task* task);
+
+    /* Holds an encoding slot for as long as it exists. */
+    class Slot {
+    public:
+        Slot(Scheduler& scheduler, clock::time_point deadline,
+             client_t client) :
+        scheduler_(scheduler), client_(client), start_(clock::now()) {
+            scheduler_.acquire(deadline, client_);
+            start_ = clock::now();
+        }
+        ~Slot() { scheduler_.release(client_, clock::now() - start_); }
+        Slot(const Slot&)            = delete;
+        Slot& operator=(const Slot&) = delete;
+    private:
+        Scheduler& scheduler_;
+        const client_t client_;
+        clock::time_point start_;
+    };
+
+private:
+    struct Ticket {
+        uint64_t seq;
+        clock::time_point deadline;
+        client_t client;
+        // The task to run, or nullptr for a thread waiting in acquire().
+        Task* task;
+    };
+
+    /*
+     * A task in step(), and where it is to be queued if it submits itself
+     * again. Once withdrawn, it is not queued again.
+     */
+    struct Running {
+        bool requeue;
+        bool withdrawn;
+        clock::time_point deadline;
+        client_t client;
+    };
+
+    struct Client {
+        // Encoding time received, in seconds divided by weight.
+        double vtime;
+        unsigned running;
+        unsigned waiting;
+    };
+
+    /** Wait until the fair queueing order gives this waiter a slot. */
+    void acquire(clock::time_point deadline, client_t client);
+    void release(client_t client, clock::duration used);
+
+    /*
+     * The parts of acquire() and release() shared with the executors. All
+     * must be called with the lock held.
+     */
+    std::list<Ticket>::iterator enqueue(clock::time_point deadline,
+                                        client_t client, Task* task);
+    void grant(std::list<Ticket>::iterator ticket);
+    void charge(client_t client, clock::duration used);
+
+    /** Body of the executor threads. */
+    void run_executor();
+
+    /** The waiter that should get the next free slot, if any may run. */
+    std::list<Ticket>::iterator next_ticket();
+
+    /** Weight and slot limit for the client. */
+    Share share(client_t client);
+
+    /** Add a slot to the load measure. Must be called with the lock held. */
+    void update_load(bool late);
+
+    /** The number of slots, from the encoders parameter. */
+    static unsigned max_running();
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    unsigned running_;
+    std::list<Ticket> waiting_;
+    std::map<client_t, Client> clients_;
+    // Virtual time of the last waiter given a slot.
+    double vtime_;
+    uint64_t next_ticket_;
+    bool shares_parsed_;
+    shares_t shares_;
+    double load_;
+    clock::time_point load_time_;
+
+    std::vector<std::thread> executors_;
+    std::map<Task*, Running> running_tasks_;
+    bool stopping_;
+};
+
+#endif
@@ -39,7 +39,9 @@ bool cmp_by_atime(const StatsCache::cache_entry_t& a1,
 
 }
 
-FileStat::FileStat(size_t _size, time_t _mtime) : size(_size), mtime(_mtime) {
+FileStat::FileStat(size_t _size, time_t _mtime, unsigned _quality,
+                   const std::vector<uint8_t>& _vbr_tag) :
+size(_size), mtime(_mtime), quality(_quality), vbr_tag(_vbr_tag) {
     update_atime();
 }
 
@@ -48,20 +50,42 @@ void FileStat::update_atime() {
 }
 
 bool FileStat::operator==(const FileStat& other) const {
-    return size == other.size && atime == other.atime && mtime == other.mtime;
+    return size == other.size && atime == other.atime &&
+        mtime == other.mtime && quality == other.quality;
+}
+
+/*
+ * Get the encoder quality that the cached entry for the given filename was
+ * encoded with, if there is a valid one. Return true if it was found.
+ */
+bool StatsCache::get_quality(const std::string& filename, time_t mtime,
+        unsigned& quality) {
+    bool in_cache = false;
+    pthread_mutex_lock(&mutex);
+    cache_t::iterator p = cache.find(filename);
+    if (p != cache.end() && mtime <= p->second.get_mtime()) {
+        in_cache = true;
+        quality = p->second.get_quality();
+    }
+    pthread_mutex_unlock(&mutex);
+    return in_cache;
 }
 
 /*
  * Get the file size from the cache for the given filename, if it exists.
  * Use 'mtime' as the modified time of the file to check for an invalid cache
- * entry. Return true if the file size was found.
+ * entry. The entry must also have been encoded with the given quality. Return
+ * true if the file size was found.
  */
 bool StatsCache::get_filesize(const std::string& filename, time_t mtime,
-        size_t& filesize) {
+        unsigned quality, size_t& filesize) {
     bool in_cache = false;
     pthread_mutex_lock(&mutex);
     cache_t::iterator p = cache.find(filename);
-    if (p != cache.end()) {
+    if (p != cache.end() && p->second.get_quality() != quality) {
+        Log(DEBUG) << "File '" << p->first << "' in stats cache has quality "
+            << p->second.get_quality() << ", not " << quality;
+    } else if (p != cache.end()) {
         FileStat& file_stat = p->second;
         if (mtime > file_stat.get_mtime()) {
             // The decoded file has changed since this entry was created, so
@@ -81,11 +105,30 @@ bool StatsCache::get_filesize(const std::string& filename, time_t mtime,
     return in_cache;
 }
 
+/*
+ * Get the VBR tag of the encoded file from the cache, if it exists, in the
+ * same way as get_filesize(). Return true if a tag was found.
+ */
+bool StatsCache::get_vbr_tag(const std::string& filename, time_t mtime,
+        unsigned quality, std::vector<uint8_t>& vbr_tag) {
+    bool in_cache = false;
+    pthread_mutex_lock(&mutex);
+    cache_t::iterator p = cache.find(filename);
+    if (p != cache.end() && mtime <= p->second.get_mtime() &&
+            quality == p->second.get_quality() &&
+            !p->second.get_vbr_tag().empty()) {
+        in_cache = true;
+        vbr_tag = p->second.get_vbr_tag();
+    }
+    pthread_mutex_unlock(&mutex);
+    return in_cache;
+}
+
 /* Add or update an entry in the stats cache */
 
 void StatsCache::put_filesize(const std::string& filename, size_t filesize,
-        time_t mtime) {
-    FileStat file_stat(filesize, mtime);
+        time_t mtime, unsigned quality, const std::vector<uint8_t>& vbr_tag) {
+    FileStat file_stat(filesize, mtime, quality, vbr_tag);
     pthread_mutex_lock(&mutex);
     cache_t::iterator p = cache.find(filename);
     if (p == cache.end()) {
@@ -21,23 +21,29 @@
 #ifndef STATS_CACHE_H
 #define STATS_CACHE_H
 
+#include <cstdint>
 #include <ctime>
 #include <map>
 #include <pthread.h>
 #include <string>
+#include <vector>
 
 /*
  * Holds the size and modified time for a file, and is used in the file stats
- * cache.
+ * cache. For VBR files, the VBR tag of the encoded file is kept as well. The
+ * encoder quality is recorded too, as the encoded file depends on it.
  */
 class FileStat {
 public:
-    FileStat(size_t _size, time_t _mtime);
+    FileStat(size_t _size, time_t _mtime, unsigned _quality,
+             const std::vector<uint8_t>& _vbr_tag);
 
     void update_atime();
     size_t get_size() const  { return size; }
+    const std::vector<uint8_t>& get_vbr_tag() const { return vbr_tag; }
     time_t get_atime() const { return atime; }
     time_t get_mtime() const { return mtime; }
+    unsigned get_quality() const { return quality; }
     bool operator==(const FileStat& other) const;
 private:
     size_t size;
@@ -46,6 +52,8 @@ private:
     time_t atime;
     // The modified time of the decoded file when the size was computed.
     time_t mtime;
+    unsigned quality;
+    std::vector<uint8_t> vbr_tag;
 };
 
 class StatsCache {
@@ -58,10 +66,15 @@ public:
     StatsCache(const StatsCache&)            = delete;
     StatsCache& operator=(const StatsCache&) = delete;
 
+    bool get_quality(const std::string& filename, time_t mtime,
+            unsigned& quality);
     bool get_filesize(const std::string& filename, time_t mtime,
-            size_t& filesize);
+            unsigned quality, size_t& filesize);
+    bool get_vbr_tag(const std::string& filename, time_t mtime,
+            unsigned quality, std::vector<uint8_t>& vbr_tag);
     void put_filesize(const std::string& filename, size_t filesize,
-            time_t mtime);
+            time_t mtime, unsigned quality,
+            const std::vector<uint8_t>& vbr_tag = {});
 private:
     void prune();
     void remove_entry(const std::string& file, const FileStat& file_stat);
@@ -21,22 +21,140 @@
 
 #include "transcode.h"
 
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
 #include <limits>
 #include <mutex>
+#include <set>
+#include <sys/stat.h>
+#include <thread>
 #include <vector>
 
 #include "codecs/coders.h"
+#include "failure_cache.h"
 #include "logging.h"
 #include "mp3fs.h"
 #include "stats_cache.h"
+#include "work_queue.h"
 
 namespace {
 
 StatsCache stats_cache;
+FailureCache failure_cache;
+Scheduler scheduler;
 
+/*
+ * Keeps track of all live Transcoders, and periodically hibernates the ones
+ * that have been idle for longer than the hibernate parameter. The thread is
+ * only started once the first Transcoder is created with hibernation
+ * enabled.
+ */
+class IdleSweeper {
+public:
+    IdleSweeper() : stopping_(false) {}
+    ~IdleSweeper();
+
+    void add(Transcoder* trans);
+    void remove(Transcoder* trans);
+
+private:
+    void run();
+
+    std::set<Transcoder*> transcoders_;
+    std::thread thread_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+IdleSweeper::~IdleSweeper() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void IdleSweeper::add(Transcoder* trans) {
+    std::lock_guard<std::mutex> l(mutex_);
+    transcoders_.insert(trans);
+    if (params.hibernate > 0 && !thread_.joinable()) {
+        thread_ = std::thread(&IdleSweeper::run, this);
+    }
+}
+
+void IdleSweeper::remove(Transcoder* trans) {
+    std::lock_guard<std::mutex> l(mutex_);
+    transcoders_.erase(trans);
+}
+
+void IdleSweeper::run() {
+    std::chrono::seconds timeout(params.hibernate);
+    std::chrono::seconds interval(std::max(params.hibernate / 4, 1u));
+
+    std::unique_lock<std::mutex> l(mutex_);
+    while (!cond_.wait_for(l, interval, [this] { return stopping_; })) {
+        Scheduler::clock::time_point idle_since =
+            Scheduler::clock::now() - timeout;
+        for (Transcoder* trans : transcoders_) {
+            trans->hibernate_if_idle(idle_since);
+        }
+    }
+}
+
+IdleSweeper idle_sweeper;
+
+// Files queued for background encoding by refine_size_async(), and the
+// Transcoder of the one being encoded, so that it can be cancelled.
+std::mutex refining_mutex;
+std::set<std::string> refining;
+Transcoder* refining_transcoder = nullptr;
+bool refining_stopped = false;
+
+// Declared after everything the jobs use, so that it is destroyed first.
+WorkQueue background_queue(1);
+
+/* Number of decoded blocks the decoder thread may run ahead in pipelined mode. */
+const size_t pipeline_depth = 16;
+
+/* Number of frames transcoded each time an encoding slot is taken. */
+const int slice_frames = 4;
+
+/* Reads further than this from the previous one are treated as seeks. */
+const off_t seek_threshold = 1024 * 1024;
+
+/* The fastest LAME quality setting, used under the heaviest load. */
+const unsigned max_quality = 9;
+
+/* How often a waiting read checks whether it has been interrupted. */
+const std::chrono::milliseconds poll_interval(100);
+
+}
+
+Transcoder::Transcoder(const std::string& filename) :
+filename_(filename), encoded_filesize_(0), source_mtime_(0),
+hibernated_(false), hibernated_size_(0),
+last_access_(Scheduler::clock::now()), active_reads_(0), audio_start_(0),
+anchor_offset_(0), last_read_end_(0), bulk_reader_(false),
+client_(Scheduler::background_client), quality_(-1), cancelled_(false),
+task_queued_(false), task_end_(0), task_error_(0) {
+    Log(DEBUG) << "Creating transcoder object for " << filename;
+    idle_sweeper.add(this);
+}
+
+Transcoder::~Transcoder() {
+    idle_sweeper.remove(this);
+    scheduler.withdraw(this);
+    stop_pipeline();
 }
 
 bool Transcoder::open() {
@@ -47,30 +165,61 @@ bool Transcoder::open() {
         return false;
     }
 
+    // Sources that failed before are not tried again until they change.
+    struct stat st;
+    bool have_stat = stat(filename_.c_str(), &st) == 0;
+    if (have_stat && failure_cache.has_failed(filename_, st)) {
+        errno = EIO;
+        return false;
+    }
+
     Log(DEBUG) << "Ready to initialize decoder.";
 
-    if (decoder_->open_file(filename_.c_str()) == -1) {
+    // Only a file that cannot be decoded is remembered, not one that could
+    // not be read, which may well work next time. The same goes for the
+    // metadata below.
+    int ret = decoder_->open_file(filename_.c_str());
+    if (ret < 0) {
+        if (ret == -2 && have_stat) {
+            failure_cache.add(filename_, st);
+        }
         errno = EIO;
         return false;
     }
 
     Log(DEBUG) << "Decoder initialized successfully.";
 
-    stats_cache.get_filesize(filename_, decoder_->mtime(),
+    source_mtime_ = decoder_->mtime();
+
+    if (quality_ < 0) {
+        quality_ = (int)choose_quality();
+    }
+
+    stats_cache.get_filesize(filename_, decoder_->mtime(), quality_,
                              encoded_filesize_);
-    encoder_.reset(Encoder::CreateEncoder(params.desttype, buffer_,
+    encoder_.reset(Encoder::CreateEncoder(params.desttype, buffer_, quality_,
                                           encoded_filesize_));
     if (!encoder_) {
         errno = EIO;
         return false;
     }
 
+    std::vector<uint8_t> vbr_tag;
+    if (stats_cache.get_vbr_tag(filename_, decoder_->mtime(), quality_,
+                                vbr_tag)) {
+        encoder_->set_vbr_tag(vbr_tag);
+    }
+
     /*
      * Process metadata. The Decoder will call the Encoder to set appropriate
      * tag values for the output file.
      */
-    if (decoder_->process_metadata(encoder_.get()) == -1) {
+    ret = decoder_->process_metadata(encoder_.get());
+    if (ret < 0) {
         Log(ERROR) << "Error processing metadata.";
+        if (ret == -2 && have_stat) {
+            failure_cache.add(filename_, st);
+        }
         errno = EIO;
         return false;
     }
@@ -86,11 +235,23 @@ bool Transcoder::open() {
 
     Log(DEBUG) << "Tag written to Buffer.";
 
+    audio_start_ = encoder_->get_tag_size();
+
     return true;
 }
 
-ssize_t Transcoder::read(char* buff, off_t offset, size_t len) {
-    std::lock_guard<std::mutex> l(mutex_);
+ssize_t Transcoder::read(char* buff, off_t offset, size_t len,
+                         int (*interrupted)()) {
+    std::unique_lock<std::mutex> l(mutex_);
+    ++active_reads_;
+    ssize_t result = read_locked(l, buff, offset, len, interrupted);
+    --active_reads_;
+    return result;
+}
+
+ssize_t Transcoder::read_locked(std::unique_lock<std::mutex>& l, char* buff,
+                                off_t offset, size_t len,
+                                int (*interrupted)()) {
     Log(DEBUG) << "Reading " << len << " bytes from offset " << offset << ".";
     if ((size_t)offset > get_size()) {
         return -1;
@@ -99,6 +260,13 @@ ssize_t Transcoder::read(char* buff, off_t offset, size_t len) {
         len = get_size() - offset;
     }
 
+    deadline_ = deadline(offset, offset + len);
+    last_access_ = Scheduler::clock::now();
+
+    if (hibernated_ && !wake()) {
+        return -1;
+    }
+
     // If the requested data has already been filled into the buffer, simply
     // copy it out.
     if (buffer_.valid_bytes(offset, len)) {
@@ -112,8 +280,23 @@ ssize_t Transcoder::read(char* buff, off_t offset, size_t len) {
         return -1;
     }
 
-    if (!transcode_until(encoder_->no_partial_encode() ?
-                         std::numeric_limits<size_t>::max() : offset + len)) {
+    if (!pace(l, interrupted) || (hibernated_ && !wake())) {
+        return -1;
+    }
+
+    // The data may have been produced for another read while this one was
+    // waiting, or that read may have finished the file.
+    if (buffer_.valid_bytes(offset, len)) {
+        buffer_.copy_into((uint8_t*)buff, offset, len);
+
+        return len;
+    } else if (!encoder_) {
+        return -1;
+    }
+
+    if (!transcode_until(l, encoder_->no_partial_encode() ?
+                         std::numeric_limits<size_t>::max() : offset + len,
+                         interrupted)) {
         return -1;
     }
 
@@ -127,8 +310,30 @@ ssize_t Transcoder::read(char* buff, off_t offset, size_t len) {
     return len;
 }
 
+bool Transcoder::prefetch(size_t end) {
+    std::unique_lock<std::mutex> l(mutex_);
+    if (!encoder_) {
+        return true;
+    }
+
+    deadline_ = Scheduler::clock::time_point::max();
+    return transcode_until(l, std::min(end, get_size()));
+}
+
+double Transcoder::sequential_fraction() {
+    std::lock_guard<std::mutex> l(mutex_);
+    if (last_read_end_ == 0 || get_size() == 0) {
+        return 0;
+    }
+
+    return (double)((off_t)last_read_end_ - anchor_offset_) /
+        (double)get_size();
+}
+
 size_t Transcoder::get_size() const {
-    if (encoded_filesize_ != 0) {
+    if (hibernated_) {
+        return hibernated_size_;
+    } else if (encoded_filesize_ != 0) {
         return encoded_filesize_;
     } else if (encoder_) {
         return encoder_->calculate_size();
@@ -137,18 +342,296 @@ size_t Transcoder::get_size() const {
     }
 }
 
-bool Transcoder::transcode_until(size_t end) {
+void Transcoder::cancel() {
+    cancelled_ = true;
+}
+
+bool Transcoder::size_is_estimate() const {
+    return encoded_filesize_ == 0 && params.vbr;
+}
+
+void Transcoder::refine_size_async(const std::string& filename,
+                                   unsigned quality) {
+    {
+        std::lock_guard<std::mutex> l(refining_mutex);
+        if (!refining.insert(filename).second) {
+            return;
+        }
+    }
+
+    Log(DEBUG) << "Queueing " << filename << " for background encoding.";
+
+    background_queue.push([filename, quality] {
+        Transcoder trans(filename);
+        trans.quality_ = (int)quality;
+        trans.deadline_ = Scheduler::clock::time_point::max();
+        {
+            std::lock_guard<std::mutex> l(refining_mutex);
+            if (refining_stopped) {
+                return;
+            }
+            refining_transcoder = &trans;
+        }
+
+        if (trans.open()) {
+            std::unique_lock<std::mutex> l(trans.mutex_);
+            trans.transcode_until(l, std::numeric_limits<size_t>::max());
+        }
+
+        std::lock_guard<std::mutex> l(refining_mutex);
+        refining_transcoder = nullptr;
+        refining.erase(filename);
+    });
+}
+
+void Transcoder::stop_refining() {
+    std::lock_guard<std::mutex> l(refining_mutex);
+    refining_stopped = true;
+    if (refining_transcoder) {
+        refining_transcoder->cancel();
+    }
+}
+
+void Transcoder::hibernate_if_idle(Scheduler::clock::time_point idle_since) {
+    std::unique_lock<std::mutex> l(mutex_, std::try_to_lock);
+    if (!l || hibernated_ || last_access_ > idle_since ||
+        buffer_.tell() == 0 || task_queued_ || active_reads_ > 0) {
+        return;
+    }
+
+    Log(DEBUG) << "Hibernating idle transcoder for " << filename_ <<
+        " after " << buffer_.tell() << " bytes.";
+
+    hibernated_size_ = get_size();
+    stop_pipeline();
+    encoder_.reset(nullptr);
+    decoder_.reset(nullptr);
+    buffer_.clear();
+    // After waking, encode only as far as the next read needs.
+    task_end_ = 0;
+    task_error_ = 0;
+    hibernated_ = true;
+}
+
+bool Transcoder::wake() {
+    Log(DEBUG) << "Waking up hibernated transcoder for " << filename_;
+
+    hibernated_ = false;
+    time_t mtime = source_mtime_;
+    if (!open() || source_mtime_ != mtime) {
+        Log(ERROR) << "Could not reopen " << filename_ <<
+            " after hibernation, or it has changed.";
+        encoder_.reset(nullptr);
+        decoder_.reset(nullptr);
+        errno = EIO;
+        return false;
+    }
+
+    return true;
+}
+
+bool Transcoder::transcode_until(std::unique_lock<std::mutex>& lock,
+                                 size_t end, int (*interrupted)()) {
+    if (params.executors > 0) {
+        if (task_error_) {
+            errno = task_error_;
+            return false;
+        }
+
+        task_end_ = std::max(task_end_, end);
+        if (!task_queued_ && task_pending()) {
+            task_queued_ = true;
+            scheduler.submit(this, deadline_, client_);
+        }
+
+        while (task_queued_ && buffer_.tell() < end) {
+            if (interrupted && interrupted()) {
+                errno = EINTR;
+                return false;
+            }
+            task_cond_.wait_for(lock, poll_interval);
+        }
+
+        if (task_error_) {
+            errno = task_error_;
+            return false;
+        } else if ((encoder_ || hibernated_) && buffer_.tell() < end) {
+            // Cancelled, or hibernated before this read woke up.
+            errno = EINTR;
+            return false;
+        }
+        return true;
+    }
+
     while (encoder_ && buffer_.tell() < end) {
-        int stat = decoder_->process_single_fr(encoder_.get());
+        Scheduler::Slot slot(scheduler, deadline_, client_);
+
+        for (int i = 0; i < slice_frames && encoder_ && buffer_.tell() < end;
+             ++i) {
+            if (cancelled_ || (interrupted && interrupted())) {
+                Log(DEBUG) << "Transcoding of " << filename_ <<
+                    " abandoned at " << buffer_.tell() << " bytes.";
+                errno = EINTR;
+                return false;
+            }
+
+            int stat = process_single_fr();
+            if (stat == -1 || (stat == 1 && !finish())) {
+                errno = EIO;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void Transcoder::step() {
+    std::lock_guard<std::mutex> l(mutex_);
+
+    for (int i = 0; i < slice_frames && task_pending(); ++i) {
+        int stat = process_single_fr();
         if (stat == -1 || (stat == 1 && !finish())) {
-            errno = EIO;
+            Log(ERROR) << "Transcoding of " << filename_ << " failed at " <<
+                buffer_.tell() << " bytes.";
+            task_error_ = EIO;
+        }
+    }
+
+    if (task_pending()) {
+        scheduler.submit(this, deadline_, client_);
+    } else {
+        task_queued_ = false;
+    }
+    task_cond_.notify_all();
+}
+
+bool Transcoder::task_pending() const {
+    return encoder_ && buffer_.tell() < task_end_ && !task_error_ &&
+        !cancelled_;
+}
+
+int Transcoder::process_single_fr() {
+    if (!params.pipeline) {
+        if (!staging_) {
+            staging_.reset(new PcmStaging(encoder_.get(),
+                                          encoder_->get_channels()));
+        }
+        int stat = decoder_->process_single_fr(staging_.get());
+        if (stat == 1 && staging_->flush() == -1) {
+            stat = -1;
+        }
+        return stat;
+    }
+
+    if (!decode_thread_.joinable()) {
+        ring_.reset(new PcmRing(pipeline_depth, encoder_->get_channels()));
+        staging_.reset(new PcmStaging(ring_.get(), encoder_->get_channels()));
+        decode_thread_ = std::thread(&Transcoder::decode_loop, this);
+    }
+
+    return ring_->pop(encoder_.get());
+}
+
+void Transcoder::decode_loop() {
+    int stat = 0;
+    while (stat == 0 && !ring_->closed() && !cancelled_) {
+        stat = decoder_->process_single_fr(staging_.get());
+    }
+    if (stat == 1) {
+        staging_->flush();
+    }
+    // If cancelled, make sure a reader waiting on the ring still wakes up.
+    ring_->push_status(stat == 0 ? -1 : stat);
+}
+
+void Transcoder::stop_pipeline() {
+    if (decode_thread_.joinable()) {
+        ring_->close();
+        decode_thread_.join();
+    }
+    staging_.reset(nullptr);
+    ring_.reset(nullptr);
+}
+
+/*
+ * Step the quality towards the fastest setting in proportion to the load.
+ * A file already in the stats cache is encoded at its cached quality if
+ * that is no worse than the load allows, so its size and VBR tag are still
+ * known. Otherwise it is encoded again at the better quality now possible,
+ * and replaces the cache entry.
+ */
+unsigned Transcoder::choose_quality() {
+    if (!params.adaptivequality) {
+        return params.quality;
+    }
+
+    double load = scheduler.load();
+    unsigned quality = params.quality +
+        (unsigned)std::lround(load * (max_quality - params.quality));
+
+    unsigned cached;
+    if (stats_cache.get_quality(filename_, decoder_->mtime(), cached) &&
+        cached >= params.quality && cached <= quality) {
+        quality = cached;
+    }
+
+    if (quality != params.quality) {
+        Log(DEBUG) << "Encoding " << filename_ << " at quality " << quality <<
+            " because encoding is behind (load " << load << ").";
+    }
+
+    return quality;
+}
+
+Scheduler::clock::time_point Transcoder::deadline(off_t offset, size_t end) {
+    Scheduler::clock::time_point now = Scheduler::clock::now();
+
+    // A read that starts before the anchor, even a nearby one, is anchored
+    // afresh, so reads never end before the anchor here or in
+    // sequential_fraction().
+    if (last_read_end_ == 0 || offset < anchor_offset_ ||
+        std::abs(offset - (off_t)last_read_end_) > seek_threshold) {
+        anchor_time_ = now;
+        anchor_offset_ = offset;
+    }
+    last_read_end_ = end;
+
+    // The tag, which may hold large pictures, takes no time to play.
+    off_t playback_start = std::max(anchor_offset_, (off_t)audio_start_);
+    double byte_rate = params.bitrate * 1000.0 / 8;
+    std::chrono::duration<double> ahead(
+        (double)std::max((off_t)end - playback_start, (off_t)0) / byte_rate);
+
+    return anchor_time_ +
+        std::chrono::duration_cast<Scheduler::clock::duration>(ahead);
+}
+
+bool Transcoder::pace(std::unique_lock<std::mutex>& lock,
+                      int (*interrupted)()) {
+    if (params.pace == 0 || bulk_reader_) {
+        return true;
+    }
+
+    Scheduler::clock::time_point resume =
+        deadline_ - std::chrono::seconds(params.pace);
+    while (Scheduler::clock::now() < resume) {
+        if (cancelled_ || (interrupted && interrupted())) {
+            errno = EINTR;
             return false;
         }
+
+        lock.unlock();
+        std::this_thread::sleep_until(std::min(resume,
+            Scheduler::clock::now() + poll_interval));
+        lock.lock();
     }
+
     return true;
 }
 
 bool Transcoder::finish() {
+    stop_pipeline();
+
     // Decoder cleanup
     time_t decoded_file_mtime = 0;
     if (decoder_) {
@@ -157,6 +640,7 @@ bool Transcoder::finish() {
     }
 
     // Encoder cleanup
+    std::vector<uint8_t> vbr_tag;
     if (encoder_) {
         if (encoder_->encode_finish() == -1) {
             return false;
@@ -164,6 +648,7 @@ bool Transcoder::finish() {
 
         /* Check encoded buffer size. */
         encoded_filesize_ = encoder_->get_actual_size();
+        vbr_tag = encoder_->get_vbr_tag();
         Log(DEBUG) << "Finishing file. Predicted size: " <<
             encoder_->calculate_size() << ", final size: " <<
             encoded_filesize_;
@@ -172,7 +657,7 @@ bool Transcoder::finish() {
 
     if (params.statcachesize > 0 && encoded_filesize_ != 0) {
         stats_cache.put_filesize(filename_, encoded_filesize_,
-                                 decoded_file_mtime);
+                                 decoded_file_mtime, quality_, vbr_tag);
     }
 
     return true;
@@ -22,48 +22,214 @@
 #ifndef MP3FS_TRANSCODE_H
 #define MP3FS_TRANSCODE_H
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
+#include <thread>
 
 #include "buffer.h"
 #include "codecs/coders.h"
 #include "logging.h"
+#include "pcm_ring.h"
+#include "pcm_staging.h"
+#include "scheduler.h"
 
-/* Transcoder for open file */
-class Transcoder {
+/*
+ * Transcoder for open file. With the executors parameter, the transcoding
+ * itself is done as a Scheduler::Task by the executor threads, and readers
+ * only wait for it.
+ */
+class Transcoder : private Scheduler::Task {
 public:
-    Transcoder(const std::string& filename) :
-    filename_(filename), encoded_filesize_(0) {
-        Log(DEBUG) << "Creating transcoder object for " << filename;
-    };
-    ~Transcoder() {};
+    Transcoder(const std::string& filename);
+    ~Transcoder();
 
     /** Initialize the transcoder. This is equivalent of a file open. */
     bool open();
 
-    /** Read bytes into the internal buffer and into the given buffer. */
-    ssize_t read(char* buff, off_t offset, size_t len);
+    /**
+     * Read bytes into the internal buffer and into the given buffer. If
+     * given, interrupted is polled between frames, and a nonzero return
+     * abandons the read with EINTR.
+     */
+    ssize_t read(char* buff, off_t offset, size_t len,
+                 int (*interrupted)() = nullptr);
+
+    /**
+     * Transcode up to end bytes ahead of any reads, at background priority.
+     * Returns false on error.
+     */
+    bool prefetch(size_t end);
+
+    /**
+     * Return the part of the file, from 0 to 1, that the reader has gone
+     * through in one sequential run up to its latest read.
+     */
+    double sequential_fraction();
+
+    /**
+     * Abandon any transcoding in progress, because nobody is going to read
+     * the result. This may be called from any thread.
+     */
+    void cancel();
+
+    /**
+     * Mark the reader of this file as a bulk copy, which is never paced
+     * (see the pace parameter).
+     */
+    void set_bulk_reader(bool bulk) { bulk_reader_ = bulk; }
+
+    /**
+     * Set the client that encoding time for this file is charged to when
+     * sharing encoders fairly (see the uidweights parameter).
+     */
+    void set_client(Scheduler::client_t client) { client_ = client; }
+
+    /** Return the name of the original file. */
+    const std::string& get_filename() const { return filename_; }
+
+    /** Return the encoder quality in use, once the file is open. */
+    unsigned get_quality() const { return (unsigned)quality_; }
 
     /** Return size of output file, as computed by Encoder. */
     size_t get_size() const;
+
+    /**
+     * Return whether get_size() is only an upper bound, as for VBR files
+     * that have not been encoded before.
+     */
+    bool size_is_estimate() const;
+
+    /**
+     * Encode the given file in the background at the lowest priority, so
+     * that its exact size ends up in the stats cache. Does nothing if the
+     * file is already queued. The quality must match the one that the size
+     * was reported for.
+     */
+    static void refine_size_async(const std::string& filename,
+                                  unsigned quality);
+
+    /**
+     * Cancel the background encoding started by refine_size_async(), and
+     * do not start any more, so that unmounting does not wait for it.
+     */
+    static void stop_refining();
+
+    /**
+     * If this Transcoder has not been read since idle_since, free the
+     * decoder, encoder and buffer, keeping only what is needed to start
+     * again. The next read re-encodes from the beginning of the file up to
+     * the requested data. Does nothing if the Transcoder is in use.
+     */
+    void hibernate_if_idle(Scheduler::clock::time_point idle_since);
 private:
+    /** Body of read(), called with mutex_ held by the lock. */
+    ssize_t read_locked(std::unique_lock<std::mutex>& l, char* buff,
+                        off_t offset, size_t len, int (*interrupted)());
+
     /**
      * Transcode into the buffer until the buffer has at least end bytes or
-     * until an error occurs.
+     * until an error occurs. Work stops early between frames if the
+     * Transcoder is cancelled or interrupted returns nonzero. The lock
+     * must hold mutex_, and is released while waiting for an executor.
      * Returns true if no errors and false otherwise.
      */
-    bool transcode_until(size_t end);
+    bool transcode_until(std::unique_lock<std::mutex>& lock, size_t end,
+                         int (*interrupted)() = nullptr);
+
+    /**
+     * Run one slice of transcoding towards task_end_ on an executor thread,
+     * and queue the next one if more is needed.
+     */
+    void step();
+
+    /** Whether the task has more to do to reach task_end_. */
+    bool task_pending() const;
+
+    /**
+     * Decode and encode a single frame. Decoded audio is collected in a
+     * PcmStaging buffer so the encoder is fed large blocks. In pipelined
+     * mode, this takes the next block produced by the decoder thread,
+     * starting it if needed.
+     * Returns the same values as Decoder::process_single_fr().
+     */
+    int process_single_fr();
+
+    /** Body of the decoder thread used in pipelined mode. */
+    void decode_loop();
+
+    /** Stop the decoder thread, if any, and wait for it to exit. */
+    void stop_pipeline();
 
     /** Close the input file and free everything but the buffer. */
     bool finish();
 
+    /** Reopen a hibernated file so transcoding can start again. */
+    bool wake();
+
+    /**
+     * Pick the encoder quality for a newly opened file: the quality
+     * parameter, or with adaptivequality, a faster setting while encoding is
+     * falling behind.
+     */
+    unsigned choose_quality();
+
+    /**
+     * Estimate when the reader will need the data up to end, assuming it
+     * plays the audio in real time from where it started or last seeked.
+     * Readers far ahead of their playback position get later deadlines.
+     */
+    Scheduler::clock::time_point deadline(off_t offset, size_t end);
+
+    /**
+     * In paced mode, wait with the lock released until the current read is
+     * no more than the pace parameter ahead of its deadline.
+     * Returns false if the wait was interrupted or cancelled.
+     */
+    bool pace(std::unique_lock<std::mutex>& lock, int (*interrupted)());
+
     Buffer buffer_;
     std::string filename_;
     size_t encoded_filesize_;
+    time_t source_mtime_;
+
+    // Size reported while hibernated, in case it was only an estimate.
+    bool hibernated_;
+    size_t hibernated_size_;
+    Scheduler::clock::time_point last_access_;
+    // Reads in progress, which may be waiting with the lock released.
+    unsigned active_reads_;
+
+    // Offset of the audio, after the tag.
+    size_t audio_start_;
+    // Read position and time from which playback is assumed to start.
+    Scheduler::clock::time_point anchor_time_;
+    off_t anchor_offset_;
+    size_t last_read_end_;
+    Scheduler::clock::time_point deadline_;
+    bool bulk_reader_;
+    Scheduler::client_t client_;
+    // Chosen on the first open, and kept when woken from hibernation so the
+    // output does not change. Negative until then.
+    int quality_;
 
     std::unique_ptr<Encoder> encoder_;
     std::unique_ptr<Decoder> decoder_;
 
+    std::atomic<bool> cancelled_;
+
+    std::unique_ptr<PcmStaging> staging_;
+    std::unique_ptr<PcmRing> ring_;
+    std::thread decode_thread_;
+
+    // State of the executor task: whether it is queued or running, how far
+    // it should transcode, and the errno it stopped with, if any.
+    bool task_queued_;
+    size_t task_end_;
+    int task_error_;
+    std::condition_variable task_cond_;
+
     std::mutex mutex_;
 };
 
@@ -0,0 +1,74 @@
+/*
+ * Background work queue source for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "work_queue.h"
+
+#include <utility>
+
+WorkQueue::~WorkQueue() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stopping_ = true;
+        jobs_.clear();
+    }
+    cond_.notify_all();
+
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkQueue::push(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        jobs_.push_back(std::move(job));
+        while (threads_.size() < num_threads_) {
+            threads_.emplace_back(&WorkQueue::run, this);
+        }
+    }
+    cond_.notify_all();
+}
+
+void WorkQueue::drain() {
+    std::unique_lock<std::mutex> l(mutex_);
+    cond_.wait(l, [this] { return jobs_.empty() && running_ == 0; });
+}
+
+void WorkQueue::run() {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (true) {
+        cond_.wait(l, [this] { return stopping_ || !jobs_.empty(); });
+        if (stopping_) {
+            return;
+        }
+
+        std::function<void()> job = std::move(jobs_.front());
+        jobs_.pop_front();
+
+        ++running_;
+        l.unlock();
+        job();
+        l.lock();
+        --running_;
+
+        // Wake drain() as well as the other workers.
+        cond_.notify_all();
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * Background work queue header for mp3fs
+ *
+ * Copyright (C) 2026 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A FIFO queue of jobs run by a fixed number of worker threads. The threads
+ * are started when the first job is pushed, so that no threads exist before
+ * FUSE has daemonized. Jobs still queued on destruction are dropped, but
+ * running jobs are waited for.
+ */
+class WorkQueue {
+public:
+    explicit WorkQueue(unsigned threads) :
+    num_threads_(threads), stopping_(false), running_(0) {}
+    ~WorkQueue();
+    WorkQueue(const WorkQueue&)            = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+
+    void push(std::function<void()> job);
+
+    /** Wait until every job pushed so far has run. */
+    void drain();
+
+private:
+    void run();
+
+    const unsigned num_threads_;
+    bool stopping_;
+    unsigned running_;
+    std::deque<std::function<void()>> jobs_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Compare the fast base64 decoder with the gnulib one, for correctness and
+ * speed.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "lib/base64.h"
+#include "lib/base64_fast.h"
+
+template <typename Op>
+double time_decoder(Op op, int rounds) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        op();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+/* Check that both decoders accept the same input and give the same data. */
+bool agree(const std::string& in) {
+    char* expected;
+    size_t expected_len;
+    bool expected_ok = base64_decode_alloc(in.data(), in.size(), &expected,
+                                           &expected_len);
+
+    std::vector<char> out(BASE64_DECODED_MAX(in.size()));
+    size_t out_len;
+    bool ok = base64_decode_fast(in.data(), in.size(), out.data(), &out_len);
+
+    bool same = ok == expected_ok && (!ok || (out_len == expected_len &&
+        std::memcmp(out.data(), expected, out_len) == 0));
+    free(expected);
+    if (!same) {
+        std::printf("%s decoder disagrees on input of %zu characters\n",
+                    base64_decode_fast_kernel(), in.size());
+    }
+    return same;
+}
+
+std::string encode(const std::vector<char>& data) {
+    std::string out(BASE64_LENGTH(data.size()), '\0');
+    base64_encode(data.data(), data.size(), &out[0], out.size());
+    return out;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 20;
+
+    // Every length around the vector block sizes, then some damage.
+    bool ok = true;
+    for (size_t len = 0; len < 200 && ok; ++len) {
+        std::vector<char> data(len);
+        for (char& c : data) {
+            c = (char)std::rand();
+        }
+        std::string in = encode(data);
+        ok = agree(in);
+        for (size_t i = 0; i < in.size() && ok; ++i) {
+            for (char bad : {'=', '\n', '\x80', '-', '\0'}) {
+                std::string damaged = in;
+                damaged[i] = bad;
+                ok = agree(damaged) && ok;
+            }
+        }
+        if (!in.empty()) {
+            ok = agree(in.substr(0, in.size() - 1)) && ok;
+        }
+    }
+
+    // A cover picture of a typical size.
+    std::vector<char> data(3 * 1024 * 1024);
+    for (char& c : data) {
+        c = (char)std::rand();
+    }
+    std::string in = encode(data);
+    std::vector<char> out(BASE64_DECODED_MAX(in.size()));
+    size_t out_len;
+
+    double gnulib_time = time_decoder([&] {
+        char* decoded;
+        size_t decoded_len;
+        base64_decode_alloc(in.data(), in.size(), &decoded, &decoded_len);
+        free(decoded);
+    }, rounds);
+    double generic_time = time_decoder([&] {
+        base64_decode_fast_generic(in.data(), in.size(), out.data(),
+                                   &out_len);
+    }, rounds);
+    double fast_time = time_decoder([&] {
+        base64_decode_fast(in.data(), in.size(), out.data(), &out_len);
+    }, rounds);
+
+    double mb = (double)in.size() * rounds / 1e6;
+    std::printf("gnulib : %8.1f MB/s\n", mb / gnulib_time);
+    std::printf("generic: %8.1f MB/s (%.2fx)\n", mb / generic_time,
+                gnulib_time / generic_time);
+    std::printf("%-7s: %8.1f MB/s (%.2fx)\n", base64_decode_fast_kernel(),
+                mb / fast_time, gnulib_time / fast_time);
+
+    return ok ? 0 : 1;
+}
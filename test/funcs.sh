@@ -1,12 +1,17 @@
 PATH=$PWD/../src:$PATH
 export LC_ALL=C
 
+unmount () {
+    hash fusermount 2>&- && fusermount -u "$1" || umount "$1"
+    rmdir "$1"
+}
+
 cleanup () {
     EXIT=$?
     # Errors are no longer fatal
     set +e
-    hash fusermount 2>&- && fusermount -u "$DIRNAME" || umount "$DIRNAME"
-    rmdir "$DIRNAME"
+    unmount "$DIRNAME"
+    [ -n "$REFDIR" ] && unmount "$REFDIR"
     exit $EXIT
 }
 
@@ -24,3 +29,13 @@ DIRNAME="$(mktemp -d)"
 while ! mount | grep -q "$DIRNAME" ; do
     sleep 0.1
 done
+
+# Mount the sources again on $REFDIR with the given options, for tests that
+# compare the output of two configurations.
+mount_reference () {
+    REFDIR="$(mktemp -d)"
+    ( mp3fs -d "$SRCDIR" "$REFDIR" --logfile=$0.ref.log "$@" || kill -USR1 $$ ) &
+    while ! mount | grep -q "$REFDIR" ; do
+        sleep 0.1
+    done
+}
@@ -0,0 +1,89 @@
+/*
+ * Compare the PCM conversion kernels chosen at runtime with the generic ones.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "codecs/pcm_convert.h"
+
+template <typename Op>
+double time_kernel(Op op, int rounds) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        op();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+template <typename T, typename In, typename Generic, typename Chosen>
+bool compare(const char* what, const std::vector<In>& in,
+             Generic generic, Chosen chosen, int rounds) {
+    std::vector<T> expected(in.size()), out(in.size());
+    double generic_time = time_kernel([&] {
+        generic(in.data(), expected.data(), in.size());
+    }, rounds);
+    double chosen_time = time_kernel([&] {
+        chosen(in.data(), out.data(), in.size());
+    }, rounds);
+
+    if (out != expected) {
+        std::printf("%s: %s kernel output differs from generic\n", what,
+                    pcm_convert_kernel());
+        return false;
+    }
+
+    double samples = (double)in.size() * rounds;
+    std::printf("%s generic: %8.1f Msamples/s\n", what,
+                samples / generic_time / 1e6);
+    std::printf("%s %-7s: %8.1f Msamples/s (%.2fx)\n", what,
+                pcm_convert_kernel(), samples / chosen_time / 1e6,
+                generic_time / chosen_time);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 20000;
+
+    // One staging block of samples for a single channel.
+    std::vector<int32_t> in(8 * 1152 + 3);
+    for (size_t i = 0; i < in.size(); ++i) {
+        in[i] = (int32_t)(std::rand() % 65536) - 32768;
+    }
+    bool ok = compare<int>("int  ", in,
+        [](const int32_t* i, int* o, size_t n) {
+            pcm_to_lame_int_generic(i, o, n, 16);
+        },
+        [](const int32_t* i, int* o, size_t n) {
+            pcm_to_lame_int(i, o, n, 16);
+        }, rounds);
+    ok = compare<short>("short", in, pcm_to_short_generic, pcm_to_short,
+                        rounds) && ok;
+
+    const float gain = 1.0f / 32768;
+    ok = compare<float>("mixi ", in,
+        [=](const int32_t* i, float* o, size_t n) {
+            pcm_mix_int_generic(o, i, gain, n);
+        },
+        [=](const int32_t* i, float* o, size_t n) {
+            pcm_mix_int(o, i, gain, n);
+        }, rounds) && ok;
+
+    std::vector<float> fin(in.size());
+    for (size_t i = 0; i < in.size(); ++i) {
+        fin[i] = (float)in[i] * gain;
+    }
+    ok = compare<float>("mixf ", fin,
+        [](const float* i, float* o, size_t n) {
+            pcm_mix_generic(o, i, 0.7071f, n);
+        },
+        [](const float* i, float* o, size_t n) {
+            pcm_mix(o, i, 0.7071f, n);
+        }, rounds) && ok;
+
+    return ok ? 0 : 1;
+}